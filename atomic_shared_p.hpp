@@ -0,0 +1,322 @@
+#pragma once
+#include "shared_p.hpp"
+#include <cassert>
+#include <cstdint>
+
+/*
+ * atomic_shared_p - a shared_p which may be loaded and replaced concurrently by many threads
+ * (e.g. a configuration snapshot or routing table, published by one thread and read by every worker).
+ *
+ * Lock-free: readers never block, and never touch a mutex. load() costs an atomic increment and
+ * decrement on the atomic_shared_p itself, plus the usual count increment for the shared_p returned.
+ *
+ * How it works (split reference counts):
+ *   Each stored value lives in a small heap node (allocated by store/exchange, which are expected to be rare).
+ *   The atomic word packs the node pointer (low 48 bits) with an "external" count (high 16 bits) of
+ *   readers currently looking at that node. A reader increments the external count to reserve the node,
+ *   copies the shared_p out of it, then gives the reservation back by decrementing the external count again.
+ *   A reader that finds the node swapped out when it gives its reservation back drops the node's own
+ *   ("internal") count instead, and the writer that swapped it out adds the external count it saw. The
+ *   internal count starts at 0 and may go negative (readers finishing before the writer has added), so
+ *   whichever of them brings it back to 0 - the writer, or the last reader - frees the node.
+ *
+ * Requires 64-bit pointers which fit in 48 bits (x86-64 / ARM64 user space), and at most 65535 loads
+ * in flight on one atomic_shared_p at once.
+ *
+ * Example usage:
+ *
+ * 		atomic_shared_p<Config> current(shared_p<Config>::make(initial));
+ *
+ * 		// worker threads
+ * 		shared_p<Config> config = current.load();
+ *
+ * 		// publisher thread
+ * 		current.store(shared_p<Config>::make(updated));
+ */
+template <typename T, typename Policy = atomic_policy>
+class atomic_shared_p
+{
+public:
+	static_assert(sizeof(void*) == 8, "atomic_shared_p packs a count into the top 16 bits of a 64-bit pointer");
+	static_assert(!std::is_same<Policy, unsynchronized_policy>::value, "atomic_shared_p needs a thread safe count policy");
+
+	// Empty
+	atomic_shared_p() noexcept;
+
+	// Holds aValue
+	explicit atomic_shared_p(shared_p<T, Policy> aValue);
+
+	// Not copyable (like std::atomic)
+	atomic_shared_p(const atomic_shared_p& aOther) = delete;
+	atomic_shared_p& operator=(const atomic_shared_p& aOther) = delete;
+
+	// Must not be destroyed while other threads are still using it
+	~atomic_shared_p();
+
+	// Is every operation lock-free on this platform?
+	bool is_lock_free() const;
+
+	// A copy of the currently held shared_p
+	shared_p<T, Policy> load() const;
+	operator shared_p<T, Policy>() const;
+
+	// Replaces the held shared_p with aValue
+	void store(shared_p<T, Policy> aValue);
+	atomic_shared_p& operator=(shared_p<T, Policy> aValue);
+
+	// Replaces the held shared_p with aValue, returning the previous one
+	shared_p<T, Policy> exchange(shared_p<T, Policy> aValue);
+
+	/* If the held shared_p is aExpected (shares its control block, or both are empty), replaces it with
+	   aDesired and returns true. Otherwise sets aExpected to (a copy of) the held shared_p and returns false.
+	   (The weak version never fails spuriously, it is provided for symmetry with std::atomic.) */
+	bool compare_exchange_strong(shared_p<T, Policy>& aExpected, shared_p<T, Policy> aDesired);
+	bool compare_exchange_weak(shared_p<T, Policy>& aExpected, shared_p<T, Policy> aDesired);
+
+private:
+
+	// A published value, with its internal count
+	struct node
+	{
+		explicit node(shared_p<T, Policy>&& aValue) : iCount(0), iValue(std::move(aValue)) { }
+
+		// Reservations handed over by the writer that swapped this node out, less those given back since it was swapped
+		// out (negative while readers have given back more than the writer has handed over yet)
+		std::atomic<long> iCount;
+		shared_p<T, Policy> iValue;
+	};
+
+	static const int kCountShift = 48;
+	static const std::uint64_t kOneReader = std::uint64_t(1) << kCountShift;
+	static const std::uint64_t kPointerMask = kOneReader - 1;
+
+	static std::uint64_t pack(node* aNode);
+	static node* node_of(std::uint64_t aWord);
+	static long readers_of(std::uint64_t aWord);
+
+	// Wraps aValue in a node (nullptr for an empty shared_p)
+	static node* make_node(shared_p<T, Policy>&& aValue);
+
+	// Gives back a reservation on aNode after it has been swapped out, freeing it if that was the last
+	static void release_node(node* aNode);
+
+	// Called by whoever swapped aWord's node out: hands its readers' reservations (less aOwn, the caller's own, which
+	// it simply gives up) to the node's internal count, freeing the node if they have all been given back
+	static void retire(std::uint64_t aWord, long aOwn = 0);
+
+	// Reserves (and returns) the current node, so it can be read without it being freed
+	node* reserve() const;
+
+	// Gives back a reservation made by reserve
+	void unreserve(node* aNode) const;
+
+	// Do these refer to the same thing? (same control block and object, or both empty)
+	static bool equivalent(const shared_p<T, Policy>& aLeft, const shared_p<T, Policy>& aRight);
+
+	// Node pointer and external (reader) count, packed
+	mutable std::atomic<std::uint64_t> iWord;
+};
+
+
+template<typename T, typename Policy>
+inline atomic_shared_p<T, Policy>::atomic_shared_p() noexcept
+	: iWord(0)
+{
+}
+
+template<typename T, typename Policy>
+inline atomic_shared_p<T, Policy>::atomic_shared_p(shared_p<T, Policy> aValue)
+	: iWord(pack(make_node(std::move(aValue))))
+{
+}
+
+template<typename T, typename Policy>
+inline atomic_shared_p<T, Policy>::~atomic_shared_p()
+{
+	retire(iWord.load(std::memory_order_acquire));
+}
+
+template<typename T, typename Policy>
+inline bool atomic_shared_p<T, Policy>::is_lock_free() const
+{
+	return iWord.is_lock_free();
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> atomic_shared_p<T, Policy>::load() const
+{
+	node* current = reserve();
+	shared_p<T, Policy> value = current ? current->iValue : shared_p<T, Policy>();
+	unreserve(current);
+	return value;
+}
+
+template<typename T, typename Policy>
+inline atomic_shared_p<T, Policy>::operator shared_p<T, Policy>() const
+{
+	return load();
+}
+
+template<typename T, typename Policy>
+inline void atomic_shared_p<T, Policy>::store(shared_p<T, Policy> aValue)
+{
+	retire(iWord.exchange(pack(make_node(std::move(aValue))), std::memory_order_acq_rel));
+}
+
+template<typename T, typename Policy>
+inline atomic_shared_p<T, Policy>& atomic_shared_p<T, Policy>::operator=(shared_p<T, Policy> aValue)
+{
+	store(std::move(aValue));
+	return *this;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> atomic_shared_p<T, Policy>::exchange(shared_p<T, Policy> aValue)
+{
+	std::uint64_t previous = iWord.exchange(pack(make_node(std::move(aValue))), std::memory_order_acq_rel);
+	node* old = node_of(previous);
+	if (!old)
+	{
+		return shared_p<T, Policy>();
+	}
+
+	// copied out before retiring: until then the node's internal count can't reach 0, so it can't be freed under us
+	// (copy rather than move: readers may be copying it concurrently)
+	shared_p<T, Policy> value = old->iValue;
+	retire(previous);
+	return value;
+}
+
+template<typename T, typename Policy>
+inline bool atomic_shared_p<T, Policy>::compare_exchange_strong(shared_p<T, Policy>& aExpected, shared_p<T, Policy> aDesired)
+{
+	node* desired = nullptr;
+	bool desiredMade = false;
+	for (;;)
+	{
+		node* current = reserve();
+		const shared_p<T, Policy> none;
+		const shared_p<T, Policy>& currentValue = current ? current->iValue : none;
+		if (!equivalent(currentValue, aExpected))
+		{
+			aExpected = currentValue;
+			unreserve(current);
+			// (never published, so no reader can have seen it)
+			delete desired;
+			return false;
+		}
+
+		if (!desiredMade)
+		{
+			desired = make_node(std::move(aDesired));
+			desiredMade = true;
+		}
+
+		std::uint64_t word = iWord.load(std::memory_order_relaxed);
+		while (node_of(word) == current)
+		{
+			if (iWord.compare_exchange_weak(word, pack(desired), std::memory_order_acq_rel, std::memory_order_relaxed))
+			{
+				// word's readers include our own reservation, which is given up rather than handed over
+				retire(word, 1);
+				return true;
+			}
+		}
+
+		// another writer got there first - try again against whatever it stored
+		unreserve(current);
+	}
+}
+
+template<typename T, typename Policy>
+inline bool atomic_shared_p<T, Policy>::compare_exchange_weak(shared_p<T, Policy>& aExpected, shared_p<T, Policy> aDesired)
+{
+	return compare_exchange_strong(aExpected, std::move(aDesired));
+}
+
+template<typename T, typename Policy>
+inline std::uint64_t atomic_shared_p<T, Policy>::pack(node* aNode)
+{
+	assert((reinterpret_cast<std::uintptr_t>(aNode) & ~kPointerMask) == 0 && "atomic_shared_p needs pointers which fit in 48 bits");
+	return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(aNode));
+}
+
+template<typename T, typename Policy>
+inline typename atomic_shared_p<T, Policy>::node* atomic_shared_p<T, Policy>::node_of(std::uint64_t aWord)
+{
+	return reinterpret_cast<node*>(static_cast<std::uintptr_t>(aWord & kPointerMask));
+}
+
+template<typename T, typename Policy>
+inline long atomic_shared_p<T, Policy>::readers_of(std::uint64_t aWord)
+{
+	return static_cast<long>(aWord >> kCountShift);
+}
+
+template<typename T, typename Policy>
+inline typename atomic_shared_p<T, Policy>::node* atomic_shared_p<T, Policy>::make_node(shared_p<T, Policy>&& aValue)
+{
+	return aValue.iControlBlock ? new node(std::move(aValue)) : nullptr;
+}
+
+template<typename T, typename Policy>
+inline void atomic_shared_p<T, Policy>::release_node(node* aNode)
+{
+	// the count only comes back to 0 from above once the writer has handed the reservations over
+	if (aNode->iCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		delete aNode;
+	}
+}
+
+template<typename T, typename Policy>
+inline void atomic_shared_p<T, Policy>::retire(std::uint64_t aWord, long aOwn)
+{
+	node* retired = node_of(aWord);
+	if (!retired)
+	{
+		return;
+	}
+
+	// each other reader releases one when it sees the node has gone (some may have already); if that leaves
+	// nothing outstanding, the node is ours to free
+	long handed = readers_of(aWord) - aOwn;
+	if (handed == 0 || retired->iCount.fetch_add(handed, std::memory_order_acq_rel) == -handed)
+	{
+		delete retired;
+	}
+}
+
+template<typename T, typename Policy>
+inline typename atomic_shared_p<T, Policy>::node* atomic_shared_p<T, Policy>::reserve() const
+{
+	std::uint64_t previous = iWord.fetch_add(kOneReader, std::memory_order_acquire);
+	assert(readers_of(previous) < 0xFFFF && "more than 65535 loads in flight on one atomic_shared_p");
+	return node_of(previous);
+}
+
+template<typename T, typename Policy>
+inline void atomic_shared_p<T, Policy>::unreserve(node* aNode) const
+{
+	std::uint64_t word = iWord.load(std::memory_order_relaxed);
+	while (node_of(word) == aNode)
+	{
+		if (iWord.compare_exchange_weak(word, word - kOneReader, std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			return;
+		}
+	}
+
+	// the node was swapped out while we were reading it, and our reservation converted into an internal count
+	// (the node can't have been freed and its address reused in the meantime, as that count is still ours)
+	if (aNode)
+	{
+		release_node(aNode);
+	}
+}
+
+template<typename T, typename Policy>
+inline bool atomic_shared_p<T, Policy>::equivalent(const shared_p<T, Policy>& aLeft, const shared_p<T, Policy>& aRight)
+{
+	return aLeft.iControlBlock == aRight.iControlBlock && aLeft.iObject == aRight.iObject;
+}
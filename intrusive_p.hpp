@@ -0,0 +1,249 @@
+#pragma once
+#include "shared_p.hpp"
+
+/*
+ * intrusive_p - a shared pointer to an object which keeps its own reference count.
+ *
+ * Same ownership rules as shared_p (make_shared takes ownership of a new'd object, the object is deleted
+ * when the last intrusive_p goes), but there is no separate control block: the handle is just a T*,
+ * get() is a single load, and make is a single allocation of T itself.
+ *
+ * T finds its count through three free functions, found by argument dependent lookup:
+ *   void intrusive_p_add_ref(const T*)   - one more intrusive_p
+ *   void intrusive_p_release(const T*)   - one fewer intrusive_p; deletes the object if that was the last one
+ *   int intrusive_p_use_count(const T*)  - the current count (must not throw: count() is noexcept)
+ * A new object must start with a count of 1 (owned by the intrusive_p that adopts it).
+ *
+ * The simplest way to provide these is to derive from intrusive_ref_counter:
+ *
+ * 		struct Message : intrusive_ref_counter<Message> { .. };
+ *
+ * 		intrusive_p<Message> m = intrusive_p<Message>::make(..);
+ * 		intrusive_p<Message> copy = m;
+ */
+template <typename T>
+class intrusive_p
+{
+public:
+	// Copy and Move Contsructors:
+	intrusive_p(const intrusive_p& aOther);
+	intrusive_p(intrusive_p&& aOther) noexcept;
+
+	// Empty (null) intrusive_p
+	constexpr intrusive_p() noexcept;
+	constexpr intrusive_p(std::nullptr_t) noexcept;
+
+	/* Public constructor (static) - takes ownership of aOther (whose count must be 1)
+
+	    Usage : T* managedT = new T(); intrusive_p<T>::make_shared(std::move(managedT));
+		        (NB: managedT subsequently nullptr after call.)
+	*/
+	SHARED_P_NODISCARD static intrusive_p make_shared(T*&& aOther);
+
+	// Public constructor (static) - constructs T from aArgs (a single allocation)
+	template <typename... Args>
+	SHARED_P_NODISCARD static intrusive_p make(Args&&... aArgs);
+
+	// Deleted, for the same reasons as the shared_p versions (use T*&&)
+	static intrusive_p make_shared(T*& aOther) = delete;
+	static intrusive_p make_shared(const T*&& aOther) = delete;
+
+	intrusive_p& operator=(const intrusive_p& aOther);
+	intrusive_p& operator=(intrusive_p&& aOther) noexcept;
+	void swap(intrusive_p& aOther) noexcept;
+
+	~intrusive_p();
+
+	// How many intrusive_p's reference the object? (0 for an empty intrusive_p)
+	SHARED_P_NODISCARD int count() const noexcept;
+
+	/* Conversion operator to T&. (T remains under intrusive_p management) */
+	operator T&() const noexcept;
+
+	// returns a reference to the shared data object (remains under intrusive_p management)
+	T& get() const noexcept;
+
+	// Pointer-like access to the shared data object
+	T* operator->() const noexcept;
+	T& operator*() const noexcept;
+
+	// Does this intrusive_p hold an object? (false if empty or moved-from)
+	explicit operator bool() const noexcept;
+
+private:
+	// Adopts the count already held on aObject
+	explicit intrusive_p(T* aObject);
+
+	T* iObject;
+};
+
+/*
+ * intrusive_ref_counter - CRTP base providing the intrusive_p count for Derived.
+ * Policy selects an atomic (default) or unsynchronized count, as for shared_p.
+ */
+template <typename Derived, typename Policy = atomic_policy>
+class intrusive_ref_counter
+{
+public:
+	friend void intrusive_p_add_ref(const intrusive_ref_counter* aObject)
+	{
+		aObject->iCount.add_ref();
+	}
+
+	friend void intrusive_p_release(const intrusive_ref_counter* aObject)
+	{
+		if (aObject->iCount.release())
+		{
+			delete static_cast<const Derived*>(aObject);
+		}
+	}
+
+	friend int intrusive_p_use_count(const intrusive_ref_counter* aObject) noexcept
+	{
+		return aObject->iCount.use_count();
+	}
+
+protected:
+	intrusive_ref_counter() { }
+
+	// copying an object doesn't copy its count (the copy has its own owners)
+	intrusive_ref_counter(const intrusive_ref_counter&) { }
+	intrusive_ref_counter& operator=(const intrusive_ref_counter&) { return *this; }
+
+	~intrusive_ref_counter() { }
+
+private:
+	static_assert(!std::is_same<Policy, biased_policy>::value, "biased_policy counts need a control block to merge into (use shared_p)");
+
+	// (the policy's weak count is unused - intrusive_p has no weak references)
+	mutable typename Policy::ref_count iCount;
+};
+
+
+template<typename T>
+inline intrusive_p<T>::intrusive_p(const intrusive_p& aOther)
+	: iObject(aOther.iObject)
+{
+	if (iObject)
+	{
+		intrusive_p_add_ref(iObject);
+	}
+}
+
+template<typename T>
+inline intrusive_p<T>::intrusive_p(intrusive_p&& aOther) noexcept
+	: iObject(aOther.iObject)
+{
+	aOther.iObject = nullptr;
+}
+
+template<typename T>
+inline constexpr intrusive_p<T>::intrusive_p() noexcept
+	: iObject(nullptr)
+{
+}
+
+template<typename T>
+inline constexpr intrusive_p<T>::intrusive_p(std::nullptr_t) noexcept
+	: iObject(nullptr)
+{
+}
+
+template<typename T>
+inline intrusive_p<T>::intrusive_p(T* aObject)
+	: iObject(aObject)
+{
+}
+
+template<typename T>
+inline intrusive_p<T> intrusive_p<T>::make_shared(T*&& aOther)
+{
+	T* data = aOther;
+	aOther = nullptr;
+	return intrusive_p<T>(data);
+}
+
+template<typename T>
+template<typename... Args>
+inline intrusive_p<T> intrusive_p<T>::make(Args&&... aArgs)
+{
+	return intrusive_p<T>(new T(std::forward<Args>(aArgs)...));
+}
+
+template<typename T>
+inline intrusive_p<T>& intrusive_p<T>::operator=(const intrusive_p& aOther)
+{
+	intrusive_p<T>(aOther).swap(*this);
+	return *this;
+}
+
+template<typename T>
+inline intrusive_p<T>& intrusive_p<T>::operator=(intrusive_p&& aOther) noexcept
+{
+	intrusive_p<T>(std::move(aOther)).swap(*this);
+	return *this;
+}
+
+template<typename T>
+inline void intrusive_p<T>::swap(intrusive_p& aOther) noexcept
+{
+	T* object = iObject;
+	iObject = aOther.iObject;
+	aOther.iObject = object;
+}
+
+template<typename T>
+inline intrusive_p<T>::~intrusive_p()
+{
+	if (iObject)
+	{
+		intrusive_p_release(iObject);
+	}
+}
+
+template<typename T>
+inline int intrusive_p<T>::count() const noexcept
+{
+	return iObject ? intrusive_p_use_count(iObject) : 0;
+}
+
+template<typename T>
+inline intrusive_p<T>::operator T&() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T>
+inline T& intrusive_p<T>::get() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T>
+inline T* intrusive_p<T>::operator->() const noexcept
+{
+	return iObject;
+}
+
+template<typename T>
+inline T& intrusive_p<T>::operator*() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T>
+inline intrusive_p<T>::operator bool() const noexcept
+{
+	return iObject != nullptr;
+}
+
+template <typename T>
+inline void swap(intrusive_p<T>& aLeft, intrusive_p<T>& aRight) noexcept
+{
+	aLeft.swap(aRight);
+}
+
+template <typename T>
+struct is_trivially_relocatable<intrusive_p<T> > : std::true_type
+{
+};
@@ -1,243 +1,2922 @@
-// 2016 Michael Cox
-#pragma once
-#include <atomic>
-#include <iostream>
-
-/*
- * shared_p - A shared pointer implementation
- *
- * shared_p allows the user to share an object without having to 
- * manually manage object lifetimes.
- * Users can provide a custom delete function to ::make_shared allowing custom destruction of T.
- *
- * Example usages:
- *
- * void fn(MyType& aData) { .. }
- * void fn(shared_ptr<MyType> aData) { .. }
- *
- * void someFunc()
- * {
- * ----------------------------------------------------------------
- * 		shared_p<MyType> sp = shared_p<MyType>::make_shared(new MyType());
- * ---------------------------------------------------------------- or
- * 		MyType* data = new MyType(5);
- * 		shared_p<MyType> sp = shared_p<MyType>::make_shared(std::move(data));
- * 		(data now null - 'ownership transferred')
- * 	-----------------------------------------------------------------
- * 		 {
- * 			 shared_p<MyType> copy = sp;
- * 			 fn(copy);     fn could be a function taking a shared_p, or a function taking a int&
- * 		 } (copy deleted here, but sp remains in scope, so data not deleted)
- * 
- * } 
- * (sp deleted, so data also deleted here as sp is last remaining shared_p)
- *
- */
-template <typename T>
-class shared_p 
-{
-public:
-
-	// -------------------------------------------- permitted constructors:
-
-	// Copy and Move Contsructors:
-	shared_p(const shared_p& other);
-	shared_p(shared_p&& other);
-
-	/* Public constructor (static)
-	
-	    Usage:	shared_p<T>::make_shared(new T())
-
-	    Usage : T* managedT = new T(); shared_p<T>::make_shared(std::move(managedT));
-		        (NB: managedT subsequently nullptr after call.)
-	*/
-	static shared_p<T> make_shared(T*&& aOther, void (*aDeleteFn)(T*));
-	static shared_p<T> make_shared(T*&& aOther);
-	
-	// --------------------------------------------- disallowed/deleted constructors:
-
-	/* Public constructor (R-value reference) 
-		- not allowed (due to trying to enforce the fact that this object is in control of the memory.
-		  e.g. Preventing e.g. make_shared(std::move(int(5))).
-		 
-		 - use T*&& version*/
-	static shared_p<T>&& make_shared(T&& aOther) = delete;
-
-	/* Public constructor (Reference) 
-		- now allowed (due to wanting to enforce move semantics) */
-	static shared_p<T>&& make_shared(T& aOther) = delete;
-	
-	/* Public constructor (Reference-of-pointer type)
-		- not allowed (due to wanting to enforce move semantics) 
-		- use T*&& version */
-	static shared_p<T> make_shared(T*& aOther) = delete;
-	
-	/* Public constructor (const R-Value Reference-of-pointer type)
-		- not allowed (due to const, we want to set other to null)
-		- use T*&& version */
-	static shared_p<T>& make_shared(const T*&& aOther) = delete;
-	
-	// Assignment operator= (not supported)
-	shared_p& operator=(const shared_p& aOther) = delete;
-
-	// ---------------------------------------------
-
-	//Destructor
-	virtual ~shared_p();
-
-	// How many shared_p's reference this control block?
-	int count();
-
-    /* Conversion operator to T&. (T remains under shared_p management)
-
-       Allows passing of shared_p, as if it was a T&, 
-       so can call functions with signitures like : void fn(T&) as fn(shared_p);
-	*/
-	operator T&();
-
-	// returns a reference to the shared data object (remains under shared_p management)
-	T& get();
-
-private:
-
-	/*
-	shared_ctrl_block - a single instance of which will be shared between all copies of shared_p for a particular T.
-	*/
-	template <typename C> //typename C, as we have to use a different typename from outer class, but typeof C == typeof T in use.
-	struct shared_ctrl_block
-	{
-		shared_ctrl_block(C* aData, void(*aDeleteFn)(C*));
-		~shared_ctrl_block();
-		
-		// The managed object
-		C* iObject;
-		
-		// Atomic int, this is important as it is what makes the whole thing thread safe
-		std::atomic_int iCount;
-		
-		// Custom delete fn
-		void(*iDeleteFn)(C*);
-	};
-
-	/* Real constructor - private to prevent construction. Users should use make_shared.
-	 * aData is the object to be managed
-	 * aDeleteFn is a custom delete function, to be called to delete the object. Is cast to global operator delete when no argument is supplied.
-	 */
-	shared_p(T* aData, void(*aDeleteFn)(T*) = reinterpret_cast<void(*)(T*)>(operator delete));
-
-	// Control Block (pointer shared between all copies of shared_p for an individual T)
-	shared_ctrl_block<T>* iControlBlock;
-};
-
-
-template<typename T>
-inline shared_p<T>::~shared_p()
-{
-	// atomically decrement count - when count is 0, delete the control block also
-	/*
-	 * This is thread safe as if there is no way to write code such that it would be possible for one thread
-	 * to be deleteing the last shared_p (i.e. when previous==1), as well as at the same time there being a copy being created elsewhere.
-	 * If we are here and previous == 1, 'this' has gone out of scope and there's no way to create a copy of this.
-	 * 
-	 * The following is invalid regardless of shared_pointers as the lifetime of s is not protected:
-	 * 		shared_p<int> s = .. ;
-	 * 		pthread_create(fn(), &s)
-	 */
-	int previous = iControlBlock->iCount.fetch_sub(1);
-	if (previous == 1)
-	{
-		delete iControlBlock;
-		iControlBlock = nullptr;
-	}
-}
-
-template<typename T>
-inline shared_p<T>::shared_p(const shared_p & aOther)
-{
-	//std::cout << "Calling shared_p copy constructor" << std::endl;
-	if (&aOther == this)
-	{
-		return;
-	}
-
-	// Add one first, as a memory leak is worse than a double delete
-	aOther.iControlBlock->iCount.fetch_add(1);
-	iControlBlock = aOther.iControlBlock;
-}
-
-template<typename T>
-inline shared_p<T>::shared_p(shared_p && aOther)
-{
-	//std::cout << "Calling shared_p move constructor" << std::endl;
-	if (&aOther == this)
-	{
-		return;
-	}
-
-	iControlBlock = aOther.iControlBlock;
-	aOther.iControlBlock = nullptr;
-}
-
-template<typename T>
-inline shared_p<T> shared_p<T>::make_shared(T *&& aOther, void(*aDeleteFn)(T*))
-{
-	//std::cout << "Calling make_shared T*&&" << std::endl;
-	T* data = aOther;
-	aOther = nullptr;
-	shared_p<T>* share = new shared_p(data, aDeleteFn);
-	return std::move(*(share));
-}
-
-template<typename T>
-inline shared_p<T> shared_p<T>::make_shared(T *&& aOther)
-{
-	return shared_p<T>::make_shared(std::move(aOther), nullptr);
-}
-
-template<typename T>
-inline shared_p<T>::shared_p(T* aData, void(*aDeleteFn)(T*))
-{
-	//std::cout << "Calling shared_p constructor" << std::endl;
-	iControlBlock = new shared_ctrl_block<T>(aData, aDeleteFn);
-}
-
-template<typename T>
-inline int shared_p<T>::count()
-{
-	return static_cast<int>(iControlBlock->iCount);
-}
-
-template<typename T>
-inline shared_p<T>::operator T&()
-{
-	return *iControlBlock->iObject;
-}
-
-template<typename T>
-inline T & shared_p<T>::get()
-{
-	return operator T&();
-}
-
-template<typename T>
-template<typename C>
-inline shared_p<T>::shared_ctrl_block<C>::shared_ctrl_block(C * aData, void(*aDeleteFn)(C*))
-	: iObject(aData), iCount(1), iDeleteFn(aDeleteFn)
-{
-}
-
-template<typename T>
-template<typename C>
-inline shared_p<T>::shared_ctrl_block<C>::~shared_ctrl_block()
-{
-	//std::cout << "Deleting control block:" << this << std::endl;
-	if (iDeleteFn)
-	{
-		iDeleteFn(iObject);
-	}
-	else {
-		delete iObject;
-	}
-
-	iObject = nullptr;
-}
+// 2016 Michael Cox
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// The language level (MSVC only reports it in _MSVC_LANG). C++17 and C++20 builds get [[nodiscard]], if constexpr
+// and [[likely]]/[[unlikely]] through the macros below; a C++11 build gets plain code in their place.
+#if defined(_MSVC_LANG)
+	#define SHARED_P_CPLUSPLUS _MSVC_LANG
+#else
+	#define SHARED_P_CPLUSPLUS __cplusplus
+#endif
+
+#if SHARED_P_CPLUSPLUS >= 201703L
+	#define SHARED_P_NODISCARD [[nodiscard]]
+	#define SHARED_P_IF_CONSTEXPR if constexpr
+#else
+	#define SHARED_P_NODISCARD
+	#define SHARED_P_IF_CONSTEXPR if
+#endif
+
+// Placed after an if's condition:  if (last) SHARED_P_UNLIKELY { ... }
+#if SHARED_P_CPLUSPLUS >= 202002L
+	#define SHARED_P_LIKELY [[likely]]
+	#define SHARED_P_UNLIKELY [[unlikely]]
+#else
+	#define SHARED_P_LIKELY
+	#define SHARED_P_UNLIKELY
+#endif
+
+// ThreadSanitizer does not model std::atomic_thread_fence, so under TSan the final release uses an
+// acquire load of the count instead (equivalent here, and visible to the sanitizer).
+#if defined(__SANITIZE_THREAD__)
+	#define SHARED_P_TSAN 1
+#elif defined(__has_feature)
+	#if __has_feature(thread_sanitizer)
+		#define SHARED_P_TSAN 1
+	#endif
+#endif
+
+// With SHARED_P_INSTRUMENTATION defined, shared_p counts its activity per type (see shared_p_instrumentation.hpp);
+// otherwise SHARED_P_INSTRUMENT expands to nothing.
+#ifdef SHARED_P_INSTRUMENTATION
+	#include "shared_p_instrumentation.hpp"
+	#define SHARED_P_INSTRUMENT(aEvent) shared_p_instrumentation::aEvent
+#else
+	#define SHARED_P_INSTRUMENT(aEvent)
+#endif
+
+// With SHARED_P_DEBUG_REGISTRY defined, every live control block is recorded, with its type and the site which
+// made it (see shared_p_registry.hpp). SHARED_P_SITE(expression) records the blocks made by expression as made
+// there; without the registry it is just (expression).
+#ifdef SHARED_P_DEBUG_REGISTRY
+	#include "shared_p_registry.hpp"
+	#include <typeinfo>
+	#define SHARED_P_REGISTRY(aCall) shared_p_registry::aCall
+	#define SHARED_P_SITE(aExpression) ((void)shared_p_registry::site(__FILE__, __LINE__), (aExpression))
+#else
+	#define SHARED_P_REGISTRY(aCall)
+	#define SHARED_P_SITE(aExpression) (aExpression)
+#endif
+
+/*
+ * Reference count policies - select how a control block counts the shared_p's which reference it.
+ *
+ *   atomic_policy         - (default) the count is a std::atomic_int; copies may be made and destroyed on any thread.
+ *                           Debug builds (without NDEBUG) assert that the count never overflows.
+ *   wide_policy           - as atomic_policy, with 64-bit counts, for objects fanned out to more than 2^31 copies.
+ *   packed_policy         - as atomic_policy, with the strong and weak counts packed into one 64-bit word, so one
+ *                           load sees both: releasing the only copy of an object no weak_p refers to takes no
+ *                           atomic read-modify-write at all.
+ *   unsynchronized_policy - the count is a plain int, with no atomic operations; for objects which never
+ *                           leave the thread that created them (and every copy of them).
+ *   biased_policy         - copies made and destroyed on the thread that created the object use a plain
+ *                           (non read-modify-write) count; other threads use an atomic count, as atomic_policy.
+ *   padded_policy<Base>   - Base's count, alone on its cache line, so threads counting unrelated objects
+ *                           allocated next to each other don't invalidate each other's lines (false sharing).
+ *   sharded_policy<N>     - the count spread over N slots, each on its own cache line, so threads copying the
+ *                           same (very hot) object don't all write one line.
+ *
+ * A policy provides a ref_count type, holding a strong count (shared_p's) and a weak count (weak_p's,
+ * plus one shared between all of the shared_p's, so the block outlives the object while weak_p's remain):
+ *   ref_count()               - starts with strong and weak both 1 (the shared_p that created the control block)
+ *   void add_ref()            - one more shared_p
+ *   void add_ref(Count n)     - n more shared_p's, in a single operation (shared_p::share_n); Count is the type
+ *                               use_count() returns, and n is never more than Count holds
+ *   bool release()            - one fewer shared_p; returns true if that was the last one (destroy the object)
+ *   bool release(Count n)     - n fewer shared_p's, in a single operation (shared_p::release_n); as release()
+ *   bool add_ref_if_nonzero() - one more shared_p, unless there are none left (weak_p::lock)
+ *   int use_count()           - the current strong count (a snapshot, if other threads hold copies); may return a
+ *                               wider type (see wide_policy), which is then what count() returns
+ *   void add_weak()           - one more weak_p
+ *   bool release_weak()       - one fewer weak count; returns true if that was the last one (free the block)
+ *
+ * shared_p's with different policies are different types, and cannot be converted into each other.
+ * Copying a shared_p is noexcept when its policy's add_ref() is (as it is for every policy here).
+ */
+struct atomic_policy
+{
+	class ref_count
+	{
+	public:
+		ref_count() : iCount(1), iWeakCount(1) { }
+
+		// relaxed is enough: the caller already holds a count, so the block cannot be destroyed concurrently,
+		// and a new reference doesn't need to order anything against other threads
+		void add_ref() noexcept { add_ref(1); }
+		void add_ref(int aCount) noexcept
+		{
+			int previous = iCount.fetch_add(aCount, std::memory_order_relaxed);
+			(void)previous;
+			assert(previous <= INT_MAX - aCount && "shared_p count overflow (see wide_policy)");
+		}
+		bool release() noexcept { return atomic_policy::release(iCount, 1); }
+		bool release(int aCount) noexcept { return atomic_policy::release(iCount, aCount); }
+
+		// lock-free: only increments while the count is still non-zero, so an expired object is never resurrected
+		bool add_ref_if_nonzero() noexcept
+		{
+			int count = iCount.load(std::memory_order_relaxed);
+			while (count != 0)
+			{
+				if (iCount.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		int use_count() const noexcept { return iCount.load(std::memory_order_relaxed); }
+
+		void add_weak() noexcept
+		{
+			int previous = iWeakCount.fetch_add(1, std::memory_order_relaxed);
+			(void)previous;
+			assert(previous < INT_MAX && "weak_p count overflow (see wide_policy)");
+		}
+		bool release_weak() noexcept { return atomic_policy::release(iWeakCount, 1); }
+
+	private:
+		// Atomic int, this is important as it is what makes the whole thing thread safe
+		std::atomic_int iCount;
+		std::atomic_int iWeakCount;
+	};
+
+	/*
+	 * Takes aReleased from aCount; returns true if that took it to zero.
+	 *
+	 * The decrement is a release, so every write this thread made to the object happens-before the
+	 * final decrement. Only the thread which releases the last count needs to see those writes,
+	 * so it alone pays for the acquire fence before the object (or block) is destroyed.
+	 */
+	static bool release(std::atomic_int& aCount, int aReleased) noexcept
+	{
+		if (aCount.fetch_sub(aReleased, std::memory_order_release) != aReleased)
+		{
+			return false;
+		}
+		acquire(aCount);
+		return true;
+	}
+
+	// The acquire half of the final release (aCount has just been released to zero)
+	template <typename Count>
+	static void acquire(std::atomic<Count>& aCount) noexcept
+	{
+#ifdef SHARED_P_TSAN
+		aCount.load(std::memory_order_acquire);
+#else
+		(void)aCount;
+		std::atomic_thread_fence(std::memory_order_acquire);
+#endif
+	}
+};
+
+/*
+ * wide_policy - as atomic_policy, but both counts are 64 bits (so count() returns long long). The count can't
+ * overflow however widely an object is fanned out, for 8 more bytes per control block.
+ */
+struct wide_policy
+{
+	class ref_count
+	{
+	public:
+		ref_count() : iCount(1), iWeakCount(1) { }
+
+		void add_ref() noexcept { iCount.fetch_add(1, std::memory_order_relaxed); }
+		void add_ref(long long aCount) noexcept { iCount.fetch_add(aCount, std::memory_order_relaxed); }
+		bool release() noexcept { return release(1); }
+		bool release(long long aCount) noexcept
+		{
+			if (iCount.fetch_sub(aCount, std::memory_order_release) != aCount)
+			{
+				return false;
+			}
+			atomic_policy::acquire(iCount);
+			return true;
+		}
+
+		bool add_ref_if_nonzero() noexcept
+		{
+			long long count = iCount.load(std::memory_order_relaxed);
+			while (count != 0)
+			{
+				if (iCount.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		long long use_count() const noexcept { return iCount.load(std::memory_order_relaxed); }
+
+		void add_weak() noexcept { iWeakCount.fetch_add(1, std::memory_order_relaxed); }
+		bool release_weak() noexcept
+		{
+			if (iWeakCount.fetch_sub(1, std::memory_order_release) != 1)
+			{
+				return false;
+			}
+			atomic_policy::acquire(iWeakCount);
+			return true;
+		}
+
+	private:
+		std::atomic<long long> iCount;
+		std::atomic<long long> iWeakCount;
+	};
+};
+
+/*
+ * packed_policy - as atomic_policy, but the strong count (low 32 bits) and weak count (high 32 bits) share one
+ * 64-bit word.
+ *
+ * A single load then shows whether the releasing shared_p holds the only counts of either kind. If it does, no
+ * other thread can reach the block (there is no copy to copy, and no weak_p to lock), so the last release and the
+ * block's weak release are plain loads and stores rather than two atomic read-modify-writes. That is the common
+ * case for short-lived objects which never had a weak_p. Otherwise it counts as atomic_policy does, and debug
+ * builds assert that neither count overflows into the other.
+ */
+struct packed_policy
+{
+	class ref_count
+	{
+	public:
+		ref_count() : iCounts(kWeakOne + 1) { }
+
+		void add_ref() noexcept { add_ref(1); }
+		void add_ref(int aCount) noexcept
+		{
+			std::uint64_t previous = iCounts.fetch_add(static_cast<std::uint64_t>(aCount), std::memory_order_relaxed);
+			(void)previous;
+			assert((previous & kStrongMask) + aCount <= kStrongMask && "shared_p count overflow (see wide_policy)");
+		}
+
+		bool release() noexcept { return release(1); }
+		bool release(int aCount) noexcept
+		{
+			// the only counts (acquire, to see everything the threads which released theirs did to the object)
+			std::uint64_t released = static_cast<std::uint64_t>(aCount);
+			if (iCounts.load(std::memory_order_acquire) == kWeakOne + released)
+			{
+				iCounts.store(kWeakOne, std::memory_order_relaxed);
+				return true;
+			}
+			if ((iCounts.fetch_sub(released, std::memory_order_release) & kStrongMask) != released)
+			{
+				return false;
+			}
+			atomic_policy::acquire(iCounts);
+			return true;
+		}
+
+		bool add_ref_if_nonzero() noexcept
+		{
+			std::uint64_t counts = iCounts.load(std::memory_order_relaxed);
+			while (counts & kStrongMask)
+			{
+				if (iCounts.compare_exchange_weak(counts, counts + 1, std::memory_order_relaxed))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		int use_count() const noexcept { return static_cast<int>(iCounts.load(std::memory_order_relaxed) & kStrongMask); }
+
+		void add_weak() noexcept
+		{
+			std::uint64_t previous = iCounts.fetch_add(kWeakOne, std::memory_order_relaxed);
+			(void)previous;
+			assert((previous >> 32) < kStrongMask && "weak_p count overflow");
+		}
+
+		bool release_weak() noexcept
+		{
+			// the last weak count, with no shared_p's left: nobody else can reach the block
+			if (iCounts.load(std::memory_order_acquire) == kWeakOne)
+			{
+				return true;
+			}
+			if (iCounts.fetch_sub(kWeakOne, std::memory_order_release) != kWeakOne)
+			{
+				return false;
+			}
+			atomic_policy::acquire(iCounts);
+			return true;
+		}
+
+	private:
+		// (both limited to 31 bits, as the interface counts in ints)
+		static const std::uint64_t kStrongMask = 0x7fffffff;
+		static const std::uint64_t kWeakOne = std::uint64_t(1) << 32;
+
+		std::atomic<std::uint64_t> iCounts;
+	};
+};
+
+struct unsynchronized_policy
+{
+	class ref_count
+	{
+	public:
+		ref_count() : iCount(1), iWeakCount(1) { }
+
+		void add_ref() noexcept { ++iCount; }
+		void add_ref(int aCount) noexcept { iCount += aCount; }
+		bool release() noexcept { return --iCount == 0; }
+		bool release(int aCount) noexcept { return (iCount -= aCount) == 0; }
+		bool add_ref_if_nonzero() noexcept { return iCount != 0 && ++iCount; }
+		int use_count() const noexcept { return iCount; }
+
+		void add_weak() noexcept { ++iWeakCount; }
+		bool release_weak() noexcept { return --iWeakCount == 0; }
+
+	private:
+		int iCount;
+		int iWeakCount;
+	};
+};
+
+template <typename Policy>
+struct shared_ctrl_block;
+
+/*
+ * biased_policy - biased reference counting: the thread which creates the control block (its owner) counts
+ * its copies in a local count with plain loads and stores (no atomic read-modify-write, no lock prefix);
+ * every other thread counts in a shared atomic count.
+ *
+ * While the owner uses its local count, the shared count holds a large bias on its behalf, so it can't reach
+ * zero. When the local count drains to zero the owner merges: it gives up the bias, and from then on counts in
+ * the shared count like every other thread. The object is destroyed when the shared count reaches zero.
+ *
+ * Counts are interchangeable, so a copy made on the owner may be destroyed on any other thread. Such a release
+ * takes the shared count below the bias; the other thread can't touch the owner's local count, so it queues
+ * the block for the owner to merge instead. The owner merges its queue on its next release of any biased
+ * shared_p, when it calls biased_policy::merge(), or when it exits (after which other threads merge for it).
+ * Until then an object whose last copy was destroyed on another thread stays alive.
+ *
+ * Best when most copies are made and destroyed by the thread which created the object.
+ * Only for shared_p (the count has to reach its control block to merge it).
+ */
+struct biased_policy
+{
+	/* Merges every count queued for the calling thread (destroying the objects whose last copies were
+	   destroyed on other threads). Returns the number merged.
+	   Call it from an owner thread which otherwise goes quiet, e.g. after joining its workers.
+	*/
+	static std::size_t merge();
+
+private:
+	struct owner;
+
+public:
+	class ref_count
+	{
+	public:
+		ref_count();
+		~ref_count();
+
+		void add_ref() noexcept { add_ref(1); }
+		void add_ref(int aCount) noexcept;
+		bool release() noexcept { return release(1); }
+		bool release(int aCount) noexcept;
+		bool add_ref_if_nonzero() noexcept;
+		int use_count() const noexcept;
+
+		void add_weak() noexcept { iWeakCount.fetch_add(1, std::memory_order_relaxed); }
+		bool release_weak() noexcept { return atomic_policy::release(iWeakCount, 1); }
+
+		// Called by the control block this count belongs to, so a merge can destroy it
+		void attach(shared_ctrl_block<biased_policy>* aBlock) { iBlock = aBlock; }
+
+	private:
+		friend struct biased_policy;
+
+		// Larger than any real count: while it is in the shared count, the shared count can't reach zero
+		static const int kBias = 1 << 30;
+
+		// Is this the owner, still counting locally?
+		bool is_owner() const;
+
+		// Only the owner writes the local count, so a store is enough (atomic only so use_count() may read it from any thread)
+		void set_local(int aCount) { iLocalCount.store(aCount, std::memory_order_relaxed); }
+
+		// Release on a thread which isn't counting locally
+		bool release_shared(int aCount);
+
+		// aCount of the owner's counts were released on another thread: queue this block for the owner to merge
+		bool release_to_owner(int aCount);
+
+		// Run by the owner (or for it, once it has exited): gives up the local count and the bias
+		void merge_local();
+
+		void release_block_weak();
+
+		owner* const iOwner;
+		shared_ctrl_block<biased_policy>* iBlock;
+
+		// Link in the owner's merge queue
+		ref_count* iNextPending;
+
+		std::atomic_int iLocalCount;
+		std::atomic<bool> iDrained;
+		std::atomic<bool> iMergeRequested;
+
+		// Other threads' counts, plus kBias until the owner merges
+		std::atomic_int iSharedCount;
+		std::atomic_int iWeakCount;
+	};
+
+private:
+	// One per thread which has created a biased count: the counts queued for it to merge.
+	// Held by the thread and by each of its counts, so it outlives both.
+	struct owner
+	{
+		owner() : iRefs(1), iExited(false), iPending(nullptr) { }
+
+		void retain() { iRefs.fetch_add(1, std::memory_order_relaxed); }
+		void release();
+
+		void push(ref_count* aCount);
+		std::size_t merge_pending();
+
+		std::atomic_int iRefs;
+		std::atomic<bool> iExited;
+		std::atomic<ref_count*> iPending;
+	};
+
+	// Merges, and lets go of, the thread's owner as the thread exits
+	struct thread_owner
+	{
+		thread_owner() : iOwner(nullptr) { }
+		~thread_owner();
+
+		owner* iOwner;
+	};
+
+	// The calling thread's owner (created on first use if aCreate, otherwise nullptr if it has none)
+	static owner* current(bool aCreate);
+};
+
+/*
+ * shared_p_cache_line - the size (and alignment) of a cache line, for keeping hot data apart.
+ */
+#if defined(__cpp_lib_hardware_interference_size) && !defined(__GNUC__)
+static const std::size_t shared_p_cache_line = std::hardware_destructive_interference_size;
+#else
+// (GCC's value depends on -mtune, so it warns against using it in a header; 64 is right for x86-64 and most ARM)
+static const std::size_t shared_p_cache_line = 64;
+#endif
+
+/*
+ * padded_policy - counts as Base does, but the count has a cache line to itself.
+ *
+ * When many small objects are allocated together their control blocks are adjacent, so without padding several
+ * counts share a cache line, and threads copying unrelated shared_p's invalidate each other's lines.
+ * The padded count has a full cache line of padding on each side, so whatever the block's alignment, nothing
+ * else written often (another block's count, or the managed object itself) can share its line.
+ * (The count is padded rather than over-aligned, as allocating over-aligned types needs C++17's aligned new,
+ * and the pool only serves fundamental alignments.) Costs two cache lines per control block.
+ *
+ * Usage:	shared_p<MyType, padded_policy<> > hot = shared_p<MyType, padded_policy<> >::make(5);
+ */
+template <typename Base = atomic_policy>
+struct padded_policy
+{
+	static_assert(!std::is_same<Base, biased_policy>::value, "biased_policy counts can't be padded (they merge through their control block's own policy)");
+
+	struct leading_pad
+	{
+		char iLeading[shared_p_cache_line];
+	};
+
+	struct trailing_pad
+	{
+		char iTrailing[shared_p_cache_line];
+	};
+
+	class ref_count : private leading_pad, public Base::ref_count, private trailing_pad
+	{
+	};
+};
+
+/*
+ * shared_p_thread_number - a small number for the calling thread (0, 1, 2, ... in the order threads first ask).
+ */
+inline std::size_t shared_p_thread_number()
+{
+	static std::atomic<std::size_t> next(0);
+	static thread_local std::size_t mine = next.fetch_add(1, std::memory_order_relaxed);
+	return mine;
+}
+
+/*
+ * sharded_policy - a distributed count, for the few objects copied by every thread (a global schema, a logger
+ * sink): with one count, every copy and release on every thread writes the same cache line.
+ *
+ * The strong count is spread over Shards slots, each on a cache line of its own, and a central count. Threads are
+ * spread over the slots in turn (threads beyond Shards share them). A copy adds to its thread's slot, and a release
+ * takes from its thread's slot - or, when that holds too few (the copy was made on another thread), from any slot
+ * which holds enough, or else from the central count. The object's count is the central count plus every slot.
+ *
+ * Each open slot holds a large bias in the central count, so the central count can't reach zero while any slot is
+ * open. Before a release the releasing thread reads the central count: while it holds a count of its own (as it
+ * does while the shared_p the object was made with is kept), taking from a slot is all. Otherwise the release goes
+ * to the central count, and as it may have been the last, it folds: every slot is closed, its count moved into the central count along with its bias, and
+ * whichever release or fold takes the central count to zero destroys the object. From then on (folding only
+ * happens as the object's last copies go) the object counts centrally, as atomic_policy.
+ *
+ * So copies and releases scale with the threads making them, as long as a count is kept centrally and copies are
+ * mostly released on the thread (or slot) that made them. Costs Shards + 2 cache lines per control block.
+ * weak_p::lock() may take a count while a fold is deciding; the object then simply stays alive.
+ *
+ * Usage:	shared_p<Schema, sharded_policy<> > gSchema = shared_p<Schema, sharded_policy<> >::make(load());
+ */
+template <std::size_t Shards = 8>
+struct sharded_policy
+{
+	static_assert(Shards > 0, "sharded_policy needs at least one slot");
+
+	class ref_count
+	{
+	public:
+		ref_count();
+
+		void add_ref() noexcept { add_ref(1); }
+		void add_ref(int aCount) noexcept;
+		bool release() noexcept { return release(1); }
+		bool release(int aCount) noexcept;
+		bool add_ref_if_nonzero() noexcept;
+		int use_count() const noexcept;
+
+		void add_weak() noexcept { iWeakCount.fetch_add(1, std::memory_order_relaxed); }
+		bool release_weak() noexcept { return atomic_policy::release(iWeakCount, 1); }
+
+	private:
+		// Held in the central count for each open slot (larger than any real count, so the low 32 bits are the count)
+		static const long long kBias = 1LL << 32;
+
+		// A slot which has been folded into the central count
+		static const int kClosed = -1;
+
+		struct slot
+		{
+			std::atomic_int iCount;
+			char iPad[shared_p_cache_line - sizeof(std::atomic_int)];
+		};
+
+		// The count held centrally, without the slots' biases
+		static int central_count(long long aCentral) { return static_cast<int>(static_cast<std::uint32_t>(aCentral)); }
+
+		// Takes aCount from aSlot, if it is open and holds that many
+		static bool take(std::atomic_int& aSlot, int aCount);
+
+		// After a release: returns true if it was the last (folding, if it might have been)
+		bool check(long long aCentral);
+		bool fold();
+
+		std::atomic_int& mine() { return iSlots[shared_p_thread_number() % Shards].iCount; }
+
+		char iLeading[shared_p_cache_line];
+		std::atomic<long long> iCentral;
+		std::atomic_int iWeakCount;
+		char iPad[shared_p_cache_line - sizeof(std::atomic<long long>) - sizeof(std::atomic_int)];
+		slot iSlots[Shards];
+	};
+};
+
+/*
+ * shared_p_ebo - holds an allocator or deleter (typically stateless) inside a control block.
+ * Empty types are held as a base class, so they take no space in the block (the empty base optimisation).
+ */
+#if SHARED_P_CPLUSPLUS >= 201402L
+template <typename T, bool = std::is_empty<T>::value && !std::is_final<T>::value>
+#else
+template <typename T, bool = std::is_empty<T>::value>
+#endif
+struct shared_p_ebo : private T
+{
+	explicit shared_p_ebo(T aValue) : T(std::move(aValue)) { }
+	T& get_ebo() { return *this; }
+};
+
+template <typename T>
+struct shared_p_ebo<T, false>
+{
+	explicit shared_p_ebo(T aValue) : iValue(std::move(aValue)) { }
+	T& get_ebo() { return iValue; }
+
+	T iValue;
+};
+
+/*
+ * shared_p_pool - per-thread free lists of fixed size blocks of memory (one list per Size/Align).
+ *
+ * Freed blocks are kept on the freeing thread's list (up to kMaxCached of them) and handed out again
+ * by the next allocate on that thread, so in steady state allocating and freeing never touches the
+ * global heap. A block may be freed on a different thread from the one that allocated it.
+ * Each thread's cached blocks are returned to the global heap when the thread exits; a block freed after that (by
+ * a thread_local or static shared_p destroyed after the thread's list) goes straight back to the global heap.
+ */
+template <std::size_t Size, std::size_t Align>
+class shared_p_pool
+{
+public:
+	static const std::size_t kMaxCached = 256;
+
+	static void* allocate();
+	static void deallocate(void* aMemory);
+
+private:
+	static_assert(Align <= alignof(std::max_align_t), "shared_p_pool only supports fundamental alignments");
+
+	struct node
+	{
+		node* iNext;
+	};
+
+	struct free_list
+	{
+		free_list() : iHead(nullptr), iLength(0) { }
+		~free_list();
+
+		node* iHead;
+		std::size_t iLength;
+	};
+
+	static const std::size_t kNodeSize = Size < sizeof(node) ? sizeof(node) : Size;
+
+	static free_list& local();
+
+	// Has this thread's list been destroyed? (a flag with no destructor, so it can still be read afterwards)
+	static bool& destroyed();
+};
+
+/*
+ * shared_p_pool_allocator - a standard allocator which serves single objects from shared_p_pool.
+ * (Arrays, i.e. allocate(n) with n > 1, go to the global heap.)
+ *
+ * Usage:	shared_p<MyType>::allocate_shared(shared_p_pool_allocator<MyType>(), 5)
+ * 		or just shared_p<MyType>::make_pooled(5)
+ */
+template <typename U>
+struct shared_p_pool_allocator
+{
+	typedef U value_type;
+
+	shared_p_pool_allocator() { }
+	template <typename V>
+	shared_p_pool_allocator(const shared_p_pool_allocator<V>&) { }
+
+	U* allocate(std::size_t aCount);
+	void deallocate(U* aMemory, std::size_t aCount);
+};
+
+template <typename U, typename V>
+inline bool operator==(const shared_p_pool_allocator<U>&, const shared_p_pool_allocator<V>&) { return true; }
+
+template <typename U, typename V>
+inline bool operator!=(const shared_p_pool_allocator<U>&, const shared_p_pool_allocator<V>&) { return false; }
+
+/*
+shared_ctrl_block - a single instance of which will be shared between all copies of shared_p for a particular object.
+
+Templated on the Policy only (not on the object type), so shared_p's of different types can share one block - a
+shared_p<Base> cast from a shared_p<Derived>, or a shared_p<Member> aliasing its parent. The derived blocks below
+know the real type of the object, and destroy it as that type.
+*/
+template <typename Policy>
+struct shared_ctrl_block
+#ifdef SHARED_P_DEBUG_REGISTRY
+	: shared_p_registry::entry
+#endif
+{
+	shared_ctrl_block();
+	virtual ~shared_ctrl_block();
+
+	// Destroys the managed object. Called once, when the last shared_p is destroyed (before the block is destroyed).
+	virtual void dispose() = 0;
+
+	// Frees the block itself (with whatever allocated it). Called after dispose.
+	virtual void destroy() = 0;
+
+#ifdef SHARED_P_DEBUG_REGISTRY
+	virtual int live_count() const { return static_cast<int>(iCount.use_count()); }
+#endif
+
+	// How many shared_p's reference this block (atomic or not, depending on Policy)
+	typename Policy::ref_count iCount;
+};
+
+/*
+shared_ptr_block - control block for an object allocated by the user and handed over to make_shared.
+*/
+template <typename C, typename Deleter, typename Policy>
+struct shared_ptr_block : shared_ctrl_block<Policy>, private shared_p_ebo<Deleter>
+{
+	shared_ptr_block(C* aData, Deleter aDeleter);
+	virtual void dispose();
+	virtual void destroy();
+
+	// The managed object (as it was handed over, so it is deleted as the type it was allocated as)
+	C* iObject;
+};
+
+/*
+shared_ptr_alloc_block - as shared_ptr_block, but the block itself is allocated (and freed) by a user-supplied
+allocator (see make_shared(aOther, aDeleter, aAlloc)).
+*/
+template <typename C, typename Deleter, typename Alloc, typename Policy>
+struct shared_ptr_alloc_block : shared_ptr_block<C, Deleter, Policy>, private ::shared_p_ebo<Alloc>
+{
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<shared_ptr_alloc_block> block_allocator;
+	typedef std::allocator_traits<block_allocator> block_traits;
+
+	// Allocates the block from aAlloc, for aData (which is not deleted if this throws)
+	static shared_ptr_alloc_block* create(C* aData, const Deleter& aDeleter, const Alloc& aAlloc);
+
+	shared_ptr_alloc_block(C* aData, const Deleter& aDeleter, const Alloc& aAlloc);
+	virtual void destroy();
+};
+
+/*
+shared_inplace_block - control block which holds the managed object inline (see make).
+*/
+template <typename C, typename Policy>
+struct shared_inplace_block : shared_ctrl_block<Policy>
+{
+	template <typename... Args>
+	shared_inplace_block(Args&&... aArgs);
+	virtual void dispose();
+	virtual void destroy();
+
+	// The managed object (lives in iStorage, so no pointer to it is kept)
+	C* object();
+
+	// Storage for the managed object, directly after the count
+	typename std::aligned_storage<sizeof(C), alignof(C)>::type iStorage;
+};
+
+/*
+shared_alloc_block - in-place control block allocated (and freed) by a user-supplied allocator (see allocate_shared).
+*/
+template <typename C, typename Alloc, typename Policy>
+struct shared_alloc_block : shared_inplace_block<C, Policy>, private shared_p_ebo<Alloc>
+{
+	typedef typename std::allocator_traits<Alloc>::template rebind_alloc<shared_alloc_block> block_allocator;
+	typedef std::allocator_traits<block_allocator> block_traits;
+
+	// Allocates the block from aAlloc, and constructs C in it from aArgs
+	template <typename... Args>
+	static shared_alloc_block* create(const Alloc& aAlloc, Args&&... aArgs);
+
+	template <typename... Args>
+	shared_alloc_block(const Alloc& aAlloc, Args&&... aArgs);
+	virtual void destroy();
+};
+
+/*
+shared_array_block - control block with an array of C's inline after it (see make_shared_array).
+The elements start on a cache line boundary (or C's own alignment, if that is larger), so the block and
+the array share a single allocation and the array can be handed straight to vectorised code.
+*/
+template <typename C, typename Policy>
+struct shared_array_block : shared_ctrl_block<Policy>
+{
+	static const std::size_t kAlignment = alignof(C) > 64 ? alignof(C) : 64;
+
+	// Allocates a block with room for aSize C's, and value-initialises them (std::bad_array_new_length if that is too many)
+	static shared_array_block* create(std::size_t aSize);
+
+	virtual void dispose();
+	virtual void destroy();
+
+	// The first element (the array is not stored as a pointer: it is always at the first aligned address after the block)
+	C* elements();
+
+	std::size_t iSize;
+
+private:
+	explicit shared_array_block(std::size_t aSize) : iSize(aSize) { }
+};
+
+/*
+ * shared_p_deferred_item - something queued on a shared_p_deferred_queue, to be reclaimed later (see make_deferred).
+ */
+struct shared_p_deferred_item
+{
+	// Destroys the object (and frees its control block, if no weak_p's remain). Called once, by drain.
+	virtual void reclaim() = 0;
+
+	shared_p_deferred_item* iNext;
+};
+
+/*
+ * shared_p_deferred_queue - objects whose destruction has been put off, until someone drains the queue.
+ *
+ * When the last shared_p to an object made by make_deferred goes, its control block is pushed here (lock-free,
+ * and without allocating) instead of the object being destroyed on that thread. drain() destroys everything
+ * queued so far on the calling thread - call it at a safe point, or let a shared_p_reclaimer (see
+ * shared_p_reclaimer.hpp) call it on a background thread.
+ *
+ * Any number of threads may push and drain concurrently. A queue drains itself when it is destroyed.
+ */
+class shared_p_deferred_queue
+{
+public:
+	shared_p_deferred_queue();
+	~shared_p_deferred_queue();
+
+	shared_p_deferred_queue(const shared_p_deferred_queue&) = delete;
+	shared_p_deferred_queue& operator=(const shared_p_deferred_queue&) = delete;
+
+	// Queues aItem for reclamation (lock-free)
+	void push(shared_p_deferred_item* aItem);
+
+	// Reclaims everything queued (including anything queued by the objects being destroyed), in the order
+	// it was queued. Returns the number of items reclaimed.
+	std::size_t drain();
+
+	// Is anything waiting to be reclaimed? (a snapshot, if other threads are pushing)
+	bool empty() const;
+
+	// The queue make_deferred uses by default (never destroyed, so not drained at exit: drain it before then)
+	static shared_p_deferred_queue& global();
+
+private:
+	std::atomic<shared_p_deferred_item*> iHead;
+};
+
+/*
+shared_deferred_block - wraps another control block type, so that its dispose() queues the block on a
+shared_p_deferred_queue rather than destroying the object there and then. The block takes a weak count while
+it is queued, so it is never freed from under the queue; reclaim() releases it after the real dispose.
+(Block must free itself with delete this, as shared_ptr_block and shared_inplace_block do.)
+*/
+template <typename Block>
+struct shared_deferred_block : Block, shared_p_deferred_item
+{
+	template <typename... Args>
+	shared_deferred_block(shared_p_deferred_queue& aQueue, Args&&... aArgs);
+
+	virtual void dispose();
+	virtual void reclaim();
+
+	shared_p_deferred_queue* iQueue;
+};
+
+/*
+ * shared_p - A shared pointer implementation
+ *
+ * shared_p allows the user to share an object without having to 
+ * manually manage object lifetimes.
+ * Users can provide a custom delete function to ::make_shared allowing custom destruction of T.
+ *
+ * Example usages:
+ *
+ * void fn(MyType& aData) { .. }
+ * void fn(shared_ptr<MyType> aData) { .. }
+ *
+ * void someFunc()
+ * {
+ * ----------------------------------------------------------------
+ * 		shared_p<MyType> sp = shared_p<MyType>::make_shared(new MyType());
+ * ---------------------------------------------------------------- or
+ * 		MyType* data = new MyType(5);
+ * 		shared_p<MyType> sp = shared_p<MyType>::make_shared(std::move(data));
+ * 		(data now null - 'ownership transferred')
+ * 	-----------------------------------------------------------------
+ * 		 {
+ * 			 shared_p<MyType> copy = sp;
+ * 			 fn(copy);     fn could be a function taking a shared_p, or a function taking a int&
+ * 		 } (copy deleted here, but sp remains in scope, so data not deleted)
+ * 
+ * } 
+ * (sp deleted, so data also deleted here as sp is last remaining shared_p)
+ *
+ * The optional Policy selects how copies are counted (see atomic_policy / unsynchronized_policy above):
+ * 		shared_p<MyType, unsynchronized_policy> local = shared_p<MyType, unsynchronized_policy>::make(5);
+ *
+ */
+template <typename T, typename Policy = atomic_policy>
+class shared_p;
+
+template <typename T, typename Policy = atomic_policy>
+class weak_p;
+
+template <typename T, typename Policy = atomic_policy>
+class borrowed_p;
+
+template <typename T, typename Policy = atomic_policy>
+class enable_shared_p_from_this;
+
+// Links an object's enable_shared_p_from_this base (if it has one) to the first shared_p made for it
+template <typename T, typename Policy, typename U>
+void shared_p_enable_from_this(const shared_p<T, Policy>& aOwner, const enable_shared_p_from_this<U, Policy>* aBase) noexcept;
+template <typename T, typename Policy>
+void shared_p_enable_from_this(const shared_p<T, Policy>& aOwner, ...) noexcept;
+
+// The type a Policy counts in, which count() returns (int, or long long for wide_policy)
+template <typename Policy>
+struct shared_p_count
+{
+	typedef decltype(std::declval<const typename Policy::ref_count&>().use_count()) type;
+};
+
+// Can a shared_p with this Policy be copied without throwing? (a copy only adds a count)
+template <typename Policy>
+struct shared_p_nothrow_copy : std::integral_constant<bool, noexcept(std::declval<typename Policy::ref_count&>().add_ref())>
+{
+};
+
+template <typename T, typename Policy>
+class shared_p 
+{
+public:
+
+	// -------------------------------------------- permitted constructors:
+
+	// Copy and Move Contsructors:
+	// (move is noexcept, so containers move rather than copy shared_p's when they grow)
+	shared_p(const shared_p& other) noexcept(shared_p_nothrow_copy<Policy>::value);
+	shared_p(shared_p&& other) noexcept;
+
+	/* Converting constructors - a shared_p<Base> from a shared_p<Derived> (or a shared_p<const T> from a shared_p<T>).
+	   Shares aOther's control block (the object is still destroyed as the type it was created as).
+	*/
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	shared_p(const shared_p<U, Policy>& aOther) noexcept(shared_p_nothrow_copy<Policy>::value);
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	shared_p(shared_p<U, Policy>&& aOther) noexcept;
+
+	/* Aliasing constructor - points at aObject, but shares ownership of (and keeps alive) aOwner's object.
+	   aObject is typically a member of, or part of, aOwner's object. No allocation: only the count is bumped
+	   (and not even that for the rvalue version, which takes over aOwner's count).
+
+	    Usage:	shared_p<Member> member(whole, &whole->iMember);
+	*/
+	template <typename U>
+	shared_p(const shared_p<U, Policy>& aOwner, T* aObject) noexcept(shared_p_nothrow_copy<Policy>::value);
+	template <typename U>
+	shared_p(shared_p<U, Policy>&& aOwner, T* aObject) noexcept;
+
+	/* Empty (null) shared_p - owns nothing, has a count() of 0, and costs nothing to destroy.
+	   A moved-from shared_p is also empty. Must not be dereferenced (operator T& / get()).
+
+	    Usage:	shared_p<T> none;  or  shared_p<T> none = nullptr;  or  existing = nullptr;
+	*/
+	constexpr shared_p() noexcept;
+	constexpr shared_p(std::nullptr_t) noexcept;
+
+	/* Public constructor (static)
+	
+	    Usage:	shared_p<T>::make_shared(new T())
+
+	    Usage : T* managedT = new T(); shared_p<T>::make_shared(std::move(managedT));
+		        (NB: managedT subsequently nullptr after call.)
+	*/
+	SHARED_P_NODISCARD static shared_p make_shared(T*&& aOther, void (*aDeleteFn)(T*));
+	SHARED_P_NODISCARD static shared_p make_shared(T*&& aOther, std::nullptr_t);
+	SHARED_P_NODISCARD static shared_p make_shared(T*&& aOther);
+
+	/* Public constructor (static, custom deleter type)
+
+	    aDeleter is any callable taking a T* (e.g. a lambda, or a function object like std::default_delete).
+	    Its type is part of the control block, so the call can be inlined, and a stateless deleter
+	    takes no space in the block (the default is std::default_delete<T>).
+
+	    Usage:	shared_p<T>::make_shared(std::move(managedT), [](T* aT) { release(aT); })
+	*/
+	template <typename Deleter>
+	SHARED_P_NODISCARD static shared_p make_shared(T*&& aOther, Deleter aDeleter);
+
+	/* Public constructor (static, custom deleter type, allocator aware)
+
+	    As make_shared(aOther, aDeleter), but the control block (holding the deleter, and a copy of aAlloc
+	    to free it) comes from aAlloc, so a stateful deleter needs no heap allocation at all.
+	    If the block can't be allocated, aDeleter is called on the object before the exception propagates.
+
+	    Usage:	shared_p<T>::make_shared(std::move(managedT), [&aPool](T* aT) { aPool.give_back(aT); }, aPool.allocator())
+	*/
+	template <typename Deleter, typename Alloc>
+	SHARED_P_NODISCARD static shared_p make_shared(T*&& aOther, Deleter aDeleter, const Alloc& aAlloc);
+
+	/* Public constructor (static, in-place)
+
+	    Constructs T from aArgs directly inside the control block, so the object and its
+	    count share a single allocation (and a single free).
+
+	    Usage:	shared_p<MyType>::make(5)
+	*/
+	template <typename... Args>
+	SHARED_P_NODISCARD static shared_p make(Args&&... aArgs);
+
+	/* Public constructor (static, in-place, allocator aware)
+
+	    As make, but the control block's storage comes from aAlloc (any standard allocator;
+	    it is rebound to the control block type, and a copy is kept in the block to free it).
+
+	    Usage:	shared_p<MyType>::allocate_shared(myArenaAllocator, 5)
+	*/
+	template <typename Alloc, typename... Args>
+	SHARED_P_NODISCARD static shared_p allocate_shared(const Alloc& aAlloc, Args&&... aArgs);
+
+	/* Public constructor (static, in-place, pooled)
+
+	    As make, but the control block comes from the calling thread's shared_p_pool,
+	    so in steady state neither construction nor destruction touches the global heap.
+
+	    Usage:	shared_p<MyType>::make_pooled(5)
+	*/
+	template <typename... Args>
+	SHARED_P_NODISCARD static shared_p make_pooled(Args&&... aArgs);
+
+	/* Public constructor (static, in-place, deferred destruction)
+
+	    As make, but when the last shared_p goes the object is not destroyed on that thread: its control block
+	    is queued on aQueue (lock-free, no allocation), and the object is destroyed when aQueue is drained.
+	    For objects which are expensive to destroy, released on latency-sensitive threads.
+
+	    Usage:	shared_p<Index>::make_deferred(shared_p_deferred_queue::global(), path)
+	    	...
+	    	shared_p_deferred_queue::global().drain();   (at a safe point, or from a shared_p_reclaimer)
+	*/
+	template <typename... Args>
+	SHARED_P_NODISCARD static shared_p make_deferred(shared_p_deferred_queue& aQueue, Args&&... aArgs);
+
+	// --------------------------------------------- disallowed/deleted constructors:
+
+	/* Public constructor (R-value reference) 
+		- not allowed (due to trying to enforce the fact that this object is in control of the memory.
+		  e.g. Preventing e.g. make_shared(std::move(int(5))).
+		 
+		 - use T*&& version*/
+	static shared_p&& make_shared(T&& aOther) = delete;
+
+	/* Public constructor (Reference) 
+		- now allowed (due to wanting to enforce move semantics) */
+	static shared_p&& make_shared(T& aOther) = delete;
+	
+	/* Public constructor (Reference-of-pointer type)
+		- not allowed (due to wanting to enforce move semantics) 
+		- use T*&& version */
+	static shared_p make_shared(T*& aOther) = delete;
+	
+	/* Public constructor (const R-Value Reference-of-pointer type)
+		- not allowed (due to const, we want to set other to null)
+		- use T*&& version
+		(a template, so it doesn't collide with the T*&& version in a shared_p<const T>) */
+	template <typename U, typename = typename std::enable_if<std::is_same<U, T>::value && !std::is_const<T>::value>::type>
+	static shared_p& make_shared(const U*&& aOther) = delete;
+	
+	// ---------------------------------------------
+
+	// Copy assignment: shares aOther's object, releasing the one currently held (safe for self-assignment)
+	shared_p& operator=(const shared_p& aOther) noexcept(shared_p_nothrow_copy<Policy>::value);
+
+	// Move assignment: takes over aOther's count without touching it, releasing the one currently held
+	shared_p& operator=(shared_p&& aOther) noexcept;
+
+	// Exchanges the objects held by this and aOther (no reference counts change)
+	void swap(shared_p& aOther) noexcept;
+
+	/* Batched sharing - writes aCount copies of this shared_p through aOut, adding all of their counts
+	   in a single operation (one atomic add with the default policy, rather than aCount of them).
+	   Returns aOut, advanced past the last copy written. Throws std::length_error, before sharing any,
+	   if aCount is more than the policy's count can hold (INT_MAX; see wide_policy).
+
+	    Usage:	std::vector<shared_p<Packet> > copies(subscribers);
+	    	packet.share_n(copies.size(), copies.begin());
+	*/
+	template <typename OutputIt>
+	OutputIt share_n(std::size_t aCount, OutputIt aOut);
+
+	/* Batched release - empties the aCount shared_p's starting at aFirst. Consecutive shared_p's with the same
+	   control block are released in a single operation, so releasing the copies made by share_n costs one
+	   atomic subtract. Returns aFirst, advanced past the last shared_p released.
+	*/
+	template <typename ForwardIt>
+	static ForwardIt release_n(ForwardIt aFirst, std::size_t aCount);
+
+	// ---------------------------------------------
+
+	//Destructor (non-virtual: shared_p is just two pointers, with no vtable, and is not intended as a base class)
+	~shared_p();
+
+	// How many shared_p's reference this control block? (0 for an empty shared_p)
+	SHARED_P_NODISCARD typename shared_p_count<Policy>::type count() const noexcept;
+
+    /* Conversion operator to T&. (T remains under shared_p management)
+
+       Allows passing of shared_p, as if it was a T&, 
+       so can call functions with signitures like : void fn(T&) as fn(shared_p);
+	*/
+	operator T&() const noexcept;
+
+	// returns a reference to the shared data object (remains under shared_p management)
+	// (const, as for a pointer: a const shared_p can't be re-pointed, but the object it shares is not const)
+	T& get() const noexcept;
+
+	// Pointer-like access to the shared data object (a single load - the object pointer is held in the shared_p itself)
+	T* operator->() const noexcept;
+	T& operator*() const noexcept;
+
+	// Does this shared_p hold an object? (false if empty or moved-from)
+	explicit operator bool() const noexcept;
+
+private:
+
+	template <typename, typename> friend class shared_p;
+	template <typename, typename> friend class weak_p;
+	template <typename, typename> friend class borrowed_p;
+	template <typename, typename> friend class atomic_shared_p;
+
+	template <typename U, typename V, typename P>
+	friend shared_p<U, P> static_pointer_cast(const shared_p<V, P>& aOther);
+	template <typename U, typename V, typename P>
+	friend shared_p<U, P> dynamic_pointer_cast(const shared_p<V, P>& aOther);
+	template <typename U, typename V, typename P>
+	friend shared_p<U, P> const_pointer_cast(const shared_p<V, P>& aOther);
+
+	// The first shared_p to a newly made object (adopts aControlBlock's count, and links any enable_shared_p_from_this base)
+	static shared_p adopt_new(shared_ctrl_block<Policy>* aControlBlock, T* aObject) noexcept;
+
+	/* Real constructor - private to prevent construction. Users should use make_shared.
+	 * aData is the object to be managed
+	 * aDeleter is called to delete the object (if allocating the control block fails, it is called immediately).
+	 */
+	template <typename Deleter>
+	shared_p(T* aData, Deleter aDeleter);
+
+	// Adopts aControlBlock (which must already hold a count for this shared_p), pointing at aObject
+	shared_p(shared_ctrl_block<Policy>* aControlBlock, T* aObject);
+
+	// The object this shared_p points at (usually the managed object; for an aliasing shared_p, the one it was given)
+	T* iObject;
+
+	// Control Block (pointer shared between all copies of shared_p for an individual object, whatever type they point at)
+	shared_ctrl_block<Policy>* iControlBlock;
+};
+
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>::~shared_p()
+{
+	// decrement count (atomically, with the default policy) - when count is 0, delete the control block also
+	/*
+	 * This is thread safe as if there is no way to write code such that it would be possible for one thread
+	 * to be deleteing the last shared_p (i.e. when previous==1), as well as at the same time there being a copy being created elsewhere.
+	 * If we are here and previous == 1, 'this' has gone out of scope and there's no way to create a copy of this.
+	 * (weak_p::lock can't either: it only adds a count while the count is still non-zero.)
+	 * 
+	 * The following is invalid regardless of shared_pointers as the lifetime of s is not protected:
+	 * 		shared_p<int> s = .. ;
+	 * 		pthread_create(fn(), &s)
+	 */
+	if (!iControlBlock)
+	{
+		// empty, or moved-from (e.g. the temporary returned from make) - nothing to release
+		return;
+	}
+
+	if (iControlBlock->iCount.release()) SHARED_P_UNLIKELY
+	{
+		iControlBlock->dispose();
+
+		// the shared_p's hold one weak count between them, so the block itself lives on while weak_p's remain
+		if (iControlBlock->iCount.release_weak())
+		{
+			iControlBlock->destroy();
+		}
+		iObject = nullptr;
+		iControlBlock = nullptr;
+	}
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>::shared_p(const shared_p & aOther) noexcept(shared_p_nothrow_copy<Policy>::value)
+{
+	//std::cout << "Calling shared_p copy constructor" << std::endl;
+	if (&aOther == this)
+	{
+		return;
+	}
+
+	// Add one first, as a memory leak is worse than a double delete
+	if (aOther.iControlBlock)
+	{
+		aOther.iControlBlock->iCount.add_ref();
+		SHARED_P_INSTRUMENT(copy<T>(1));
+	}
+	iObject = aOther.iObject;
+	iControlBlock = aOther.iControlBlock;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>::shared_p(shared_p && aOther) noexcept
+{
+	//std::cout << "Calling shared_p move constructor" << std::endl;
+	if (&aOther == this)
+	{
+		return;
+	}
+
+	iObject = aOther.iObject;
+	iControlBlock = aOther.iControlBlock;
+	aOther.iObject = nullptr;
+	aOther.iControlBlock = nullptr;
+	if (iControlBlock)
+	{
+		SHARED_P_INSTRUMENT(move<T>());
+	}
+}
+
+template<typename T, typename Policy>
+inline constexpr shared_p<T, Policy>::shared_p() noexcept
+	: iObject(nullptr), iControlBlock(nullptr)
+{
+}
+
+template<typename T, typename Policy>
+inline constexpr shared_p<T, Policy>::shared_p(std::nullptr_t) noexcept
+	: iObject(nullptr), iControlBlock(nullptr)
+{
+}
+
+template<typename T, typename Policy>
+template<typename U, typename>
+inline shared_p<T, Policy>::shared_p(const shared_p<U, Policy>& aOther) noexcept(shared_p_nothrow_copy<Policy>::value)
+	: shared_p(aOther, aOther.iObject)
+{
+}
+
+template<typename T, typename Policy>
+template<typename U, typename>
+inline shared_p<T, Policy>::shared_p(shared_p<U, Policy>&& aOther) noexcept
+	: shared_p(std::move(aOther), aOther.iObject)
+{
+}
+
+template<typename T, typename Policy>
+template<typename U>
+inline shared_p<T, Policy>::shared_p(const shared_p<U, Policy>& aOwner, T* aObject) noexcept(shared_p_nothrow_copy<Policy>::value)
+	: iObject(aObject), iControlBlock(aOwner.iControlBlock)
+{
+	if (iControlBlock)
+	{
+		iControlBlock->iCount.add_ref();
+		SHARED_P_INSTRUMENT(copy<T>(1));
+	}
+}
+
+template<typename T, typename Policy>
+template<typename U>
+inline shared_p<T, Policy>::shared_p(shared_p<U, Policy>&& aOwner, T* aObject) noexcept
+	: iObject(aObject), iControlBlock(aOwner.iControlBlock)
+{
+	aOwner.iObject = nullptr;
+	aOwner.iControlBlock = nullptr;
+	if (iControlBlock)
+	{
+		SHARED_P_INSTRUMENT(move<T>());
+	}
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>& shared_p<T, Policy>::operator=(const shared_p & aOther) noexcept(shared_p_nothrow_copy<Policy>::value)
+{
+	// copy first, so assigning a shared_p to itself (or to another copy of itself) can't release the last count
+	shared_p<T, Policy>(aOther).swap(*this);
+	return *this;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>& shared_p<T, Policy>::operator=(shared_p && aOther) noexcept
+{
+	// the temporary takes over our previous object, and releases it as it goes out of scope
+	shared_p<T, Policy>(std::move(aOther)).swap(*this);
+	return *this;
+}
+
+template<typename T, typename Policy>
+inline void shared_p<T, Policy>::swap(shared_p & aOther) noexcept
+{
+	using std::swap;
+	swap(iObject, aOther.iObject);
+	swap(iControlBlock, aOther.iControlBlock);
+}
+
+template<typename T, typename Policy>
+template<typename OutputIt>
+inline OutputIt shared_p<T, Policy>::share_n(std::size_t aCount, OutputIt aOut)
+{
+	typedef typename shared_p_count<Policy>::type count_type;
+	if (aCount > static_cast<typename std::make_unsigned<count_type>::type>(std::numeric_limits<count_type>::max()))
+	{
+		throw std::length_error("shared_p::share_n: more copies than the count can hold");
+	}
+	if (iControlBlock && aCount)
+	{
+		iControlBlock->iCount.add_ref(static_cast<count_type>(aCount));
+		SHARED_P_INSTRUMENT(copy<T>(aCount));
+	}
+
+	std::size_t written = 0;
+	try
+	{
+		for (; written < aCount; ++written)
+		{
+			// each copy adopts one of the counts added above
+			shared_p copy(iControlBlock, iObject);
+			*aOut = std::move(copy);
+			++aOut;
+		}
+	}
+	catch (...)
+	{
+		// the copy being written released its own count as it unwound; give back the ones never handed out
+		// (this shared_p still holds a count, so this can't be the last)
+		if (iControlBlock)
+		{
+			iControlBlock->iCount.release(static_cast<count_type>(aCount - written - 1));
+		}
+		throw;
+	}
+	return aOut;
+}
+
+template<typename T, typename Policy>
+template<typename ForwardIt>
+inline ForwardIt shared_p<T, Policy>::release_n(ForwardIt aFirst, std::size_t aCount)
+{
+	while (aCount)
+	{
+		// empty the run of shared_p's sharing this control block, then release them all at once
+		shared_ctrl_block<Policy>* block = (*aFirst).iControlBlock;
+		typename shared_p_count<Policy>::type run = 0;
+		do
+		{
+			shared_p& handle = *aFirst;
+			handle.iObject = nullptr;
+			handle.iControlBlock = nullptr;
+			++aFirst;
+			--aCount;
+			++run;
+		} while (aCount && (*aFirst).iControlBlock == block);
+
+		// as ~shared_p
+		if (block && block->iCount.release(run)) SHARED_P_UNLIKELY
+		{
+			block->dispose();
+			if (block->iCount.release_weak())
+			{
+				block->destroy();
+			}
+		}
+	}
+	return aFirst;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_shared(T *&& aOther, void(*aDeleteFn)(T*))
+{
+	//std::cout << "Calling make_shared T*&&" << std::endl;
+	if (!aDeleteFn)
+	{
+		return make_shared(std::move(aOther));
+	}
+
+	T* data = aOther;
+	aOther = nullptr;
+	return shared_p<T, Policy>(data, aDeleteFn);
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_shared(T *&& aOther, std::nullptr_t)
+{
+	return make_shared(std::move(aOther));
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_shared(T *&& aOther)
+{
+	return make_shared(std::move(aOther), std::default_delete<T>());
+}
+
+template<typename T, typename Policy>
+template<typename Deleter>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_shared(T *&& aOther, Deleter aDeleter)
+{
+	T* data = aOther;
+	aOther = nullptr;
+	return shared_p<T, Policy>(data, std::move(aDeleter));
+}
+
+template<typename T, typename Policy>
+template<typename Deleter, typename Alloc>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_shared(T *&& aOther, Deleter aDeleter, const Alloc& aAlloc)
+{
+	T* data = aOther;
+	aOther = nullptr;
+
+	shared_ptr_alloc_block<T, Deleter, Alloc, Policy>* block;
+	try
+	{
+		block = shared_ptr_alloc_block<T, Deleter, Alloc, Policy>::create(data, aDeleter, aAlloc);
+	}
+	catch (...)
+	{
+		// as the (T*, Deleter) constructor: we own data from the moment make_shared is called
+		aDeleter(data);
+		throw;
+	}
+	return adopt_new(block, data);
+}
+
+template<typename T, typename Policy>
+template<typename... Args>
+inline shared_p<T, Policy> shared_p<T, Policy>::make(Args&&... aArgs)
+{
+	shared_inplace_block<T, Policy>* block = new shared_inplace_block<T, Policy>(std::forward<Args>(aArgs)...);
+	return adopt_new(block, block->object());
+}
+
+template<typename T, typename Policy>
+template<typename Alloc, typename... Args>
+inline shared_p<T, Policy> shared_p<T, Policy>::allocate_shared(const Alloc& aAlloc, Args&&... aArgs)
+{
+	shared_alloc_block<T, Alloc, Policy>* block = shared_alloc_block<T, Alloc, Policy>::create(aAlloc, std::forward<Args>(aArgs)...);
+	return adopt_new(block, block->object());
+}
+
+template<typename T, typename Policy>
+template<typename... Args>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_pooled(Args&&... aArgs)
+{
+	return allocate_shared(shared_p_pool_allocator<T>(), std::forward<Args>(aArgs)...);
+}
+
+template<typename T, typename Policy>
+template<typename... Args>
+inline shared_p<T, Policy> shared_p<T, Policy>::make_deferred(shared_p_deferred_queue& aQueue, Args&&... aArgs)
+{
+	typedef shared_deferred_block<shared_inplace_block<T, Policy> > block_type;
+	block_type* block = new block_type(aQueue, std::forward<Args>(aArgs)...);
+	return adopt_new(block, block->object());
+}
+
+template<typename T, typename Policy>
+template<typename Deleter>
+inline shared_p<T, Policy>::shared_p(T* aData, Deleter aDeleter)
+	: iObject(aData)
+{
+	//std::cout << "Calling shared_p constructor" << std::endl;
+	try
+	{
+		iControlBlock = new shared_ptr_block<T, Deleter, Policy>(aData, aDeleter);
+	}
+	catch (...)
+	{
+		// we own aData from the moment make_shared is called, so don't leak it
+		aDeleter(aData);
+		throw;
+	}
+	shared_p_enable_from_this(*this, aData);
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>::shared_p(shared_ctrl_block<Policy>* aControlBlock, T* aObject)
+	: iObject(aObject), iControlBlock(aControlBlock)
+{
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> shared_p<T, Policy>::adopt_new(shared_ctrl_block<Policy>* aControlBlock, T* aObject) noexcept
+{
+	shared_p<T, Policy> owner(aControlBlock, aObject);
+	shared_p_enable_from_this(owner, aObject);
+	return owner;
+}
+
+template<typename T, typename Policy>
+inline typename shared_p_count<Policy>::type shared_p<T, Policy>::count() const noexcept
+{
+	return iControlBlock ? iControlBlock->iCount.use_count() : 0;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>::operator T&() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T, typename Policy>
+inline T & shared_p<T, Policy>::get() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T, typename Policy>
+inline T * shared_p<T, Policy>::operator->() const noexcept
+{
+	return iObject;
+}
+
+template<typename T, typename Policy>
+inline T & shared_p<T, Policy>::operator*() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy>::operator bool() const noexcept
+{
+	return iObject != nullptr;
+}
+
+// Lets a policy's count find the control block it belongs to (only biased_policy's needs to)
+template <typename Count, typename Block>
+inline void shared_p_attach_count(Count&, Block*)
+{
+}
+
+inline void shared_p_attach_count(biased_policy::ref_count& aCount, shared_ctrl_block<biased_policy>* aBlock)
+{
+	aCount.attach(aBlock);
+}
+
+template<typename Policy>
+inline shared_ctrl_block<Policy>::shared_ctrl_block()
+{
+	shared_p_attach_count(iCount, this);
+}
+
+template<typename Policy>
+inline shared_ctrl_block<Policy>::~shared_ctrl_block()
+{
+	//std::cout << "Deleting control block:" << this << std::endl;
+	SHARED_P_REGISTRY(remove(this));
+}
+
+template<typename C, typename Deleter, typename Policy>
+inline shared_ptr_block<C, Deleter, Policy>::shared_ptr_block(C * aData, Deleter aDeleter)
+	: shared_p_ebo<Deleter>(std::move(aDeleter)), iObject(aData)
+{
+	SHARED_P_INSTRUMENT(construct<C>(sizeof(shared_ptr_block) + sizeof(C)));
+	SHARED_P_REGISTRY(add(this, typeid(C).name()));
+}
+
+template<typename C, typename Deleter, typename Policy>
+inline void shared_ptr_block<C, Deleter, Policy>::dispose()
+{
+	SHARED_P_INSTRUMENT(final_release<C>());
+	this->get_ebo()(iObject);
+}
+
+template<typename C, typename Deleter, typename Policy>
+inline void shared_ptr_block<C, Deleter, Policy>::destroy()
+{
+	SHARED_P_INSTRUMENT(destroy<C>(sizeof(shared_ptr_block) + sizeof(C)));
+	delete this;
+}
+
+template<typename C, typename Deleter, typename Alloc, typename Policy>
+inline shared_ptr_alloc_block<C, Deleter, Alloc, Policy>* shared_ptr_alloc_block<C, Deleter, Alloc, Policy>::create(C* aData, const Deleter& aDeleter, const Alloc& aAlloc)
+{
+	block_allocator alloc(aAlloc);
+	shared_ptr_alloc_block* block = block_traits::allocate(alloc, 1);
+	try
+	{
+		new (block) shared_ptr_alloc_block(aData, aDeleter, aAlloc);
+	}
+	catch (...)
+	{
+		block_traits::deallocate(alloc, block, 1);
+		throw;
+	}
+	return block;
+}
+
+template<typename C, typename Deleter, typename Alloc, typename Policy>
+inline shared_ptr_alloc_block<C, Deleter, Alloc, Policy>::shared_ptr_alloc_block(C* aData, const Deleter& aDeleter, const Alloc& aAlloc)
+	: shared_ptr_block<C, Deleter, Policy>(aData, aDeleter), ::shared_p_ebo<Alloc>(aAlloc)
+{
+}
+
+template<typename C, typename Deleter, typename Alloc, typename Policy>
+inline void shared_ptr_alloc_block<C, Deleter, Alloc, Policy>::destroy()
+{
+	// copy the allocator out first, as it lives in the block being freed
+	block_allocator alloc(::shared_p_ebo<Alloc>::get_ebo());
+	SHARED_P_INSTRUMENT(destroy<C>(sizeof(shared_ptr_block<C, Deleter, Policy>) + sizeof(C)));
+	this->~shared_ptr_alloc_block();
+	block_traits::deallocate(alloc, this, 1);
+}
+
+template<typename C, typename Policy>
+template<typename... Args>
+inline shared_inplace_block<C, Policy>::shared_inplace_block(Args&&... aArgs)
+{
+	// If C's constructor throws, the new-expression frees the block; the base never sees a half-built object
+	new (&iStorage) C(std::forward<Args>(aArgs)...);
+	SHARED_P_INSTRUMENT(construct<C>(sizeof(shared_inplace_block)));
+	SHARED_P_REGISTRY(add(this, typeid(C).name()));
+}
+
+template<typename C, typename Policy>
+inline C* shared_inplace_block<C, Policy>::object()
+{
+	return reinterpret_cast<C*>(&iStorage);
+}
+
+template<typename C, typename Policy>
+inline void shared_inplace_block<C, Policy>::dispose()
+{
+	SHARED_P_INSTRUMENT(final_release<C>());
+	object()->~C();
+}
+
+template<typename C, typename Policy>
+inline void shared_inplace_block<C, Policy>::destroy()
+{
+	SHARED_P_INSTRUMENT(destroy<C>(sizeof(shared_inplace_block)));
+	delete this;
+}
+
+template<typename C, typename Alloc, typename Policy>
+template<typename... Args>
+inline shared_alloc_block<C, Alloc, Policy>* shared_alloc_block<C, Alloc, Policy>::create(const Alloc& aAlloc, Args&&... aArgs)
+{
+	block_allocator alloc(aAlloc);
+	shared_alloc_block* block = block_traits::allocate(alloc, 1);
+	try
+	{
+		new (block) shared_alloc_block(aAlloc, std::forward<Args>(aArgs)...);
+	}
+	catch (...)
+	{
+		block_traits::deallocate(alloc, block, 1);
+		throw;
+	}
+	return block;
+}
+
+template<typename C, typename Alloc, typename Policy>
+template<typename... Args>
+inline shared_alloc_block<C, Alloc, Policy>::shared_alloc_block(const Alloc& aAlloc, Args&&... aArgs)
+	: shared_inplace_block<C, Policy>(std::forward<Args>(aArgs)...), shared_p_ebo<Alloc>(aAlloc)
+{
+}
+
+template<typename C, typename Alloc, typename Policy>
+inline void shared_alloc_block<C, Alloc, Policy>::destroy()
+{
+	// copy the allocator out first, as it lives in the block being freed
+	block_allocator alloc(this->get_ebo());
+	SHARED_P_INSTRUMENT(destroy<C>(sizeof(shared_inplace_block<C, Policy>)));
+	this->~shared_alloc_block();
+	block_traits::deallocate(alloc, this, 1);
+}
+
+template<typename C, typename Policy>
+inline shared_array_block<C, Policy>* shared_array_block<C, Policy>::create(std::size_t aSize)
+{
+	// worst case padding between the end of the block and the first aligned address is kAlignment - 1
+	static const std::size_t kHeader = sizeof(shared_array_block) + kAlignment - 1;
+
+	// as new C[aSize] would, rather than let the size wrap round to a smaller allocation
+	if (aSize > (SIZE_MAX - kHeader) / sizeof(C))
+	{
+		throw std::bad_array_new_length();
+	}
+	void* memory = ::operator new(kHeader + aSize * sizeof(C));
+	shared_array_block* block = new (memory) shared_array_block(aSize);
+	C* elements = block->elements();
+	std::size_t constructed = 0;
+	try
+	{
+		for (; constructed < aSize; ++constructed)
+		{
+			new (elements + constructed) C();
+		}
+	}
+	catch (...)
+	{
+		while (constructed)
+		{
+			elements[--constructed].~C();
+		}
+		block->~shared_array_block();
+		::operator delete(memory);
+		throw;
+	}
+	SHARED_P_INSTRUMENT(construct<C>(sizeof(shared_array_block) + aSize * sizeof(C)));
+	SHARED_P_REGISTRY(add(block, typeid(C[]).name()));
+	return block;
+}
+
+template<typename C, typename Policy>
+inline C* shared_array_block<C, Policy>::elements()
+{
+	std::uintptr_t end = reinterpret_cast<std::uintptr_t>(this) + sizeof(shared_array_block);
+	return reinterpret_cast<C*>((end + kAlignment - 1) & ~static_cast<std::uintptr_t>(kAlignment - 1));
+}
+
+template<typename C, typename Policy>
+inline void shared_array_block<C, Policy>::dispose()
+{
+	SHARED_P_INSTRUMENT(final_release<C>());
+
+	// destroy in the reverse order of construction, as delete[] would
+	C* array = elements();
+	for (std::size_t i = iSize; i > 0; --i)
+	{
+		array[i - 1].~C();
+	}
+}
+
+template<typename C, typename Policy>
+inline void shared_array_block<C, Policy>::destroy()
+{
+	SHARED_P_INSTRUMENT(destroy<C>(sizeof(shared_array_block) + iSize * sizeof(C)));
+	this->~shared_array_block();
+	::operator delete(this);
+}
+
+inline std::size_t biased_policy::merge()
+{
+	owner* self = current(false);
+	return self ? self->merge_pending() : 0;
+}
+
+inline biased_policy::ref_count::ref_count()
+	: iOwner(current(true)), iBlock(nullptr), iNextPending(nullptr), iLocalCount(1), iDrained(false),
+	iMergeRequested(false), iSharedCount(kBias), iWeakCount(1)
+{
+	iOwner->retain();
+}
+
+inline biased_policy::ref_count::~ref_count()
+{
+	iOwner->release();
+}
+
+inline bool biased_policy::ref_count::is_owner() const
+{
+	return !iDrained.load(std::memory_order_relaxed) && iOwner == current(false)
+		&& !iOwner->iExited.load(std::memory_order_relaxed);
+}
+
+inline void biased_policy::ref_count::add_ref(int aCount) noexcept
+{
+	if (is_owner())
+	{
+		set_local(iLocalCount.load(std::memory_order_relaxed) + aCount);
+		return;
+	}
+	iSharedCount.fetch_add(aCount, std::memory_order_relaxed);
+}
+
+inline bool biased_policy::ref_count::release(int aCount) noexcept
+{
+	if (!is_owner())
+	{
+		return release_shared(aCount);
+	}
+
+	int local = iLocalCount.load(std::memory_order_relaxed);
+	if (aCount < local)
+	{
+		set_local(local - aCount);
+
+		// a convenient point to merge anything other threads have handed back
+		if (iOwner->iPending.load(std::memory_order_relaxed))
+		{
+			iOwner->merge_pending();
+		}
+		return false;
+	}
+
+	// this empties the local count: give up the bias, along with anything over (counts made on
+	// other threads, released here), and count in the shared count from now on
+	set_local(0);
+	iDrained.store(true, std::memory_order_relaxed);
+	return atomic_policy::release(iSharedCount, kBias + aCount - local);
+}
+
+inline bool biased_policy::ref_count::release_shared(int aCount)
+{
+	int count = iSharedCount.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if (count >= kBias && count - aCount < kBias)
+		{
+			// more released than other threads ever added: some of these were the owner's
+			return release_to_owner(aCount);
+		}
+		if (iSharedCount.compare_exchange_weak(count, count - aCount, std::memory_order_release, std::memory_order_relaxed))
+		{
+			if (count != aCount)
+			{
+				return false;
+			}
+			atomic_policy::acquire(iSharedCount);
+			return true;
+		}
+	}
+}
+
+inline bool biased_policy::ref_count::release_to_owner(int aCount)
+{
+	// the queue holds a weak count, so the block outlives its place in the queue
+	// (taken while we still hold our counts, so the block can't have gone yet)
+	bool queue = !iMergeRequested.exchange(true, std::memory_order_relaxed);
+	if (queue)
+	{
+		add_weak();
+	}
+
+	// the owner may have merged in the meantime, in which case this can be the last release
+	bool last = atomic_policy::release(iSharedCount, aCount);
+
+	if (queue)
+	{
+		// once pushed, the block (and with it the last reference to the owner) may go at any time
+		owner* blockOwner = iOwner;
+		blockOwner->retain();
+		blockOwner->push(this);
+
+		// if the owner has already exited, nobody else will merge its queue
+		if (blockOwner->iExited.load())
+		{
+			blockOwner->merge_pending();
+		}
+		blockOwner->release();
+	}
+	return last;
+}
+
+inline bool biased_policy::ref_count::add_ref_if_nonzero() noexcept
+{
+	if (is_owner())
+	{
+		// the owner still counts locally, so the object hasn't been destroyed
+		add_ref();
+		return true;
+	}
+
+	// the bias keeps the shared count non-zero until the owner merges
+	int count = iSharedCount.load(std::memory_order_relaxed);
+	while (count != 0)
+	{
+		if (iSharedCount.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+inline int biased_policy::ref_count::use_count() const noexcept
+{
+	int bias = iDrained.load(std::memory_order_relaxed) ? 0 : kBias;
+	return iLocalCount.load(std::memory_order_relaxed) + iSharedCount.load(std::memory_order_relaxed) - bias;
+}
+
+inline void biased_policy::ref_count::merge_local()
+{
+	if (!iDrained.load(std::memory_order_relaxed))
+	{
+		int local = iLocalCount.load(std::memory_order_relaxed);
+		set_local(0);
+		iDrained.store(true, std::memory_order_relaxed);
+
+		// as ~shared_p, if that leaves no copies anywhere
+		if (atomic_policy::release(iSharedCount, kBias - local))
+		{
+			iBlock->dispose();
+			release_block_weak();
+		}
+	}
+
+	// the queue's weak count
+	release_block_weak();
+}
+
+inline void biased_policy::ref_count::release_block_weak()
+{
+	if (release_weak())
+	{
+		iBlock->destroy();
+	}
+}
+
+inline void biased_policy::owner::release()
+{
+	if (atomic_policy::release(iRefs, 1))
+	{
+		delete this;
+	}
+}
+
+inline void biased_policy::owner::push(ref_count* aCount)
+{
+	// sequentially consistent, with the load of iExited after it, so either the owner sees this
+	// count as it exits, or the pusher sees that it has exited
+	aCount->iNextPending = iPending.load(std::memory_order_relaxed);
+	while (!iPending.compare_exchange_weak(aCount->iNextPending, aCount))
+	{
+	}
+}
+
+inline std::size_t biased_policy::owner::merge_pending()
+{
+	std::size_t merged = 0;
+
+	// take the whole queue at once; merging destroys objects, which may queue more
+	while (ref_count* pending = iPending.exchange(nullptr))
+	{
+		while (pending)
+		{
+			ref_count* next = pending->iNextPending;
+			pending->merge_local();
+			pending = next;
+			++merged;
+		}
+	}
+	return merged;
+}
+
+inline biased_policy::thread_owner::~thread_owner()
+{
+	if (iOwner)
+	{
+		// from here on this thread's counts are all in their shared counts, and anything queued
+		// after this is merged by whichever thread queues it
+		iOwner->iExited.store(true);
+		iOwner->merge_pending();
+		owner* exited = iOwner;
+		iOwner = nullptr;
+		exited->release();
+	}
+}
+
+inline biased_policy::owner* biased_policy::current(bool aCreate)
+{
+	static thread_local thread_owner self;
+	if (!self.iOwner && aCreate)
+	{
+		self.iOwner = new owner();
+	}
+	return self.iOwner;
+}
+
+template <std::size_t Shards>
+inline sharded_policy<Shards>::ref_count::ref_count()
+	: iCentral(1 + static_cast<long long>(Shards) * kBias), iWeakCount(1)
+{
+	for (std::size_t i = 0; i < Shards; ++i)
+	{
+		iSlots[i].iCount.store(0, std::memory_order_relaxed);
+	}
+}
+
+template <std::size_t Shards>
+inline void sharded_policy<Shards>::ref_count::add_ref(int aCount) noexcept
+{
+	std::atomic_int& slot = mine();
+	int count = slot.load(std::memory_order_relaxed);
+	while (count != kClosed)
+	{
+		if (slot.compare_exchange_weak(count, count + aCount, std::memory_order_relaxed))
+		{
+			return;
+		}
+	}
+	iCentral.fetch_add(aCount, std::memory_order_relaxed);
+}
+
+template <std::size_t Shards>
+inline bool sharded_policy<Shards>::ref_count::release(int aCount) noexcept
+{
+	// read while this count is still held (once it is given up, the block may go at any moment). While the central
+	// count holds a count of its own, a release from a slot can't be the last: whichever release later takes the
+	// central count to zero folds, and its fold sees this slot.
+	if (central_count(iCentral.load(std::memory_order_seq_cst)) > 0) SHARED_P_LIKELY
+	{
+		// this thread's slot first; the others only when the counts were added elsewhere
+		std::size_t first = shared_p_thread_number() % Shards;
+		for (std::size_t i = 0; i < Shards; ++i)
+		{
+			if (take(iSlots[(first + i) % Shards].iCount, aCount))
+			{
+				return false;
+			}
+		}
+	}
+
+	long long central = iCentral.fetch_sub(aCount, std::memory_order_seq_cst) - aCount;
+	if (central == 0)
+	{
+		// every slot was closed, and this was the last count
+		return true;
+	}
+	return check(central);
+}
+
+template <std::size_t Shards>
+inline bool sharded_policy<Shards>::ref_count::add_ref_if_nonzero() noexcept
+{
+	// a count in an open slot means there are copies, and the open slot's bias that the object hasn't gone
+	std::atomic_int& slot = mine();
+	int count = slot.load(std::memory_order_relaxed);
+	while (count > 0)
+	{
+		if (slot.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+
+	long long central = iCentral.load(std::memory_order_relaxed);
+	while (central != 0)
+	{
+		if (iCentral.compare_exchange_weak(central, central + 1, std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+template <std::size_t Shards>
+inline int sharded_policy<Shards>::ref_count::use_count() const noexcept
+{
+	int count = central_count(iCentral.load(std::memory_order_relaxed));
+	for (std::size_t i = 0; i < Shards; ++i)
+	{
+		int slot = iSlots[i].iCount.load(std::memory_order_relaxed);
+		if (slot != kClosed)
+		{
+			count += slot;
+		}
+	}
+	return count;
+}
+
+template <std::size_t Shards>
+inline bool sharded_policy<Shards>::ref_count::take(std::atomic_int& aSlot, int aCount)
+{
+	// (a closed slot's kClosed is less than any count)
+	int count = aSlot.load(std::memory_order_relaxed);
+	while (count >= aCount)
+	{
+		if (aSlot.compare_exchange_weak(count, count - aCount, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+template <std::size_t Shards>
+inline bool sharded_policy<Shards>::ref_count::check(long long aCentral)
+{
+	// while a count is held centrally the object has copies, wherever the other counts are; otherwise the total
+	// may be zero (the slots can't be negative), so fold and find out
+	if (central_count(aCentral) > 0) SHARED_P_LIKELY
+	{
+		return false;
+	}
+	return fold();
+}
+
+template <std::size_t Shards>
+inline bool sharded_policy<Shards>::ref_count::fold()
+{
+	// several threads may fold at once: each slot is closed by exactly one of them, and the central count only
+	// reaches zero once every slot is closed, so only one moves it there
+	bool last = false;
+	for (std::size_t i = 0; i < Shards; ++i)
+	{
+		int count = iSlots[i].iCount.exchange(kClosed, std::memory_order_seq_cst);
+		if (count != kClosed && iCentral.fetch_add(count - kBias, std::memory_order_seq_cst) == kBias - count)
+		{
+			last = true;
+		}
+	}
+	return last;
+}
+
+inline shared_p_deferred_queue::shared_p_deferred_queue()
+	: iHead(nullptr)
+{
+}
+
+inline shared_p_deferred_queue::~shared_p_deferred_queue()
+{
+	drain();
+}
+
+inline void shared_p_deferred_queue::push(shared_p_deferred_item* aItem)
+{
+	// release, so the drainer sees the object as the last shared_p left it
+	aItem->iNext = iHead.load(std::memory_order_relaxed);
+	while (!iHead.compare_exchange_weak(aItem->iNext, aItem, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+inline std::size_t shared_p_deferred_queue::drain()
+{
+	std::size_t reclaimed = 0;
+
+	// take the whole list at once (so items are never popped singly, and there is no ABA problem);
+	// destroying an object may queue more, so keep going until the queue stays empty
+	while (shared_p_deferred_item* pushed = iHead.exchange(nullptr, std::memory_order_acquire))
+	{
+		// the list is newest first - reverse it, so objects are destroyed in the order they were released
+		shared_p_deferred_item* oldest = nullptr;
+		while (pushed)
+		{
+			shared_p_deferred_item* next = pushed->iNext;
+			pushed->iNext = oldest;
+			oldest = pushed;
+			pushed = next;
+		}
+
+		while (oldest)
+		{
+			shared_p_deferred_item* next = oldest->iNext;
+			oldest->reclaim();
+			oldest = next;
+			++reclaimed;
+		}
+	}
+	return reclaimed;
+}
+
+inline bool shared_p_deferred_queue::empty() const
+{
+	return iHead.load(std::memory_order_relaxed) == nullptr;
+}
+
+inline shared_p_deferred_queue& shared_p_deferred_queue::global()
+{
+	// never destroyed: static objects holding deferred shared_p's may release them (pushing onto the queue)
+	// while static objects are destroyed
+	static shared_p_deferred_queue* queue = new shared_p_deferred_queue();
+	return *queue;
+}
+
+template<typename Block>
+template<typename... Args>
+inline shared_deferred_block<Block>::shared_deferred_block(shared_p_deferred_queue& aQueue, Args&&... aArgs)
+	: Block(std::forward<Args>(aArgs)...), iQueue(&aQueue)
+{
+}
+
+template<typename Block>
+inline void shared_deferred_block<Block>::dispose()
+{
+	// keep the block alive while it is queued (the shared_p's weak count is released as soon as we return)
+	this->iCount.add_weak();
+	iQueue->push(this);
+}
+
+template<typename Block>
+inline void shared_deferred_block<Block>::reclaim()
+{
+	Block::dispose();
+	if (this->iCount.release_weak())
+	{
+		this->destroy();
+	}
+}
+
+template<std::size_t Size, std::size_t Align>
+inline void* shared_p_pool<Size, Align>::allocate()
+{
+	if (destroyed())
+	{
+		return ::operator new(kNodeSize);
+	}
+	free_list& list = local();
+	if (node* head = list.iHead)
+	{
+		list.iHead = head->iNext;
+		--list.iLength;
+		return head;
+	}
+	return ::operator new(kNodeSize);
+}
+
+template<std::size_t Size, std::size_t Align>
+inline void shared_p_pool<Size, Align>::deallocate(void* aMemory)
+{
+	if (destroyed())
+	{
+		::operator delete(aMemory);
+		return;
+	}
+	free_list& list = local();
+	if (list.iLength >= kMaxCached)
+	{
+		::operator delete(aMemory);
+		return;
+	}
+	node* freed = static_cast<node*>(aMemory);
+	freed->iNext = list.iHead;
+	list.iHead = freed;
+	++list.iLength;
+}
+
+template<std::size_t Size, std::size_t Align>
+inline shared_p_pool<Size, Align>::free_list::~free_list()
+{
+	while (iHead)
+	{
+		node* next = iHead->iNext;
+		::operator delete(iHead);
+		iHead = next;
+	}
+	destroyed() = true;
+}
+
+template<std::size_t Size, std::size_t Align>
+inline typename shared_p_pool<Size, Align>::free_list& shared_p_pool<Size, Align>::local()
+{
+	static thread_local free_list list;
+	return list;
+}
+
+template<std::size_t Size, std::size_t Align>
+inline bool& shared_p_pool<Size, Align>::destroyed()
+{
+	static thread_local bool flag = false;
+	return flag;
+}
+
+template<typename U>
+inline U* shared_p_pool_allocator<U>::allocate(std::size_t aCount)
+{
+	if (aCount == 1)
+	{
+		return static_cast<U*>(shared_p_pool<sizeof(U), alignof(U)>::allocate());
+	}
+	return static_cast<U*>(::operator new(aCount * sizeof(U)));
+}
+
+template<typename U>
+inline void shared_p_pool_allocator<U>::deallocate(U* aMemory, std::size_t aCount)
+{
+	if (aCount == 1)
+	{
+		shared_p_pool<sizeof(U), alignof(U)>::deallocate(aMemory);
+		return;
+	}
+	::operator delete(aMemory);
+}
+
+/*
+ * weak_p - a non-owning reference to an object managed by shared_p.
+ *
+ * A weak_p doesn't keep the object alive: the object is destroyed when the last shared_p goes,
+ * and the control block is freed when the last weak_p goes too.
+ * lock() upgrades to a shared_p (lock-free), which is empty if the object has already been destroyed.
+ *
+ * Example usage:
+ *
+ * 		shared_p<MyType> sp = shared_p<MyType>::make(5);
+ * 		weak_p<MyType> cached = sp;
+ * 		...
+ * 		shared_p<MyType> again = cached.lock();
+ * 		if (again.count()) { use(again.get()); }
+ */
+template <typename T, typename Policy>
+class weak_p
+{
+public:
+	// Empty weak_p (lock() always returns an empty shared_p)
+	constexpr weak_p() noexcept;
+
+	// Weak reference to aShared's object (an empty weak_p if aShared is empty)
+	weak_p(const shared_p<T, Policy>& aShared) noexcept;
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	weak_p(const shared_p<U, Policy>& aShared) noexcept;
+
+	weak_p(const weak_p& aOther) noexcept;
+	weak_p(weak_p&& aOther) noexcept;
+
+	weak_p& operator=(const weak_p& aOther) noexcept;
+	weak_p& operator=(weak_p&& aOther) noexcept;
+	weak_p& operator=(const shared_p<T, Policy>& aShared) noexcept;
+
+	~weak_p();
+
+	// A shared_p to the object, or an empty shared_p if it has already been destroyed
+	SHARED_P_NODISCARD shared_p<T, Policy> lock() const noexcept;
+
+	// Has the object been destroyed? (or is this weak_p empty)
+	SHARED_P_NODISCARD bool expired() const noexcept;
+
+	// How many shared_p's reference the object? (0 once it has been destroyed)
+	SHARED_P_NODISCARD typename shared_p_count<Policy>::type count() const noexcept;
+
+	void swap(weak_p& aOther) noexcept;
+
+private:
+	typedef shared_ctrl_block<Policy> ctrl_block;
+
+	template <typename U, typename P, typename V>
+	friend void shared_p_enable_from_this(const shared_p<U, P>& aOwner, const enable_shared_p_from_this<V, P>* aBase) noexcept;
+
+	// Weak reference to aShared's block, locking to aObject (the object's own base may be filled from a shared_p<const T>)
+	template <typename U>
+	weak_p(const shared_p<U, Policy>& aShared, T* aObject) noexcept;
+
+	// The object lock() points at (kept alongside the block, as with shared_p, so an aliasing shared_p's weak_p locks to the same object)
+	T* iObject;
+	ctrl_block* iControlBlock;
+};
+
+
+/*
+ * is_trivially_relocatable - opt-in trait for types that can be moved to a new address
+ * by copying their bytes (memcpy) and then forgetting the source, without running
+ * the move constructor or the destructor.
+ *
+ * Defaults to std::is_trivially_copyable. shared_p opts in: it is a pair of pointers (object and
+ * control block), and nothing refers back to the address of the handle itself.
+ */
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T>
+{
+};
+
+template <typename T, typename Policy>
+struct is_trivially_relocatable<shared_p<T, Policy> > : std::true_type
+{
+};
+
+/* Relocates aCount objects from aSource into the uninitialised storage at aDest.
+ * Afterwards the objects at aSource are gone (they must not be destroyed, only their storage reused or freed).
+ * Uses a single memcpy when T is trivially relocatable, otherwise move-constructs and destroys each element.
+ */
+template <typename T>
+inline void relocate_n(T* aSource, std::size_t aCount, T* aDest)
+	noexcept(is_trivially_relocatable<T>::value || std::is_nothrow_move_constructible<T>::value)
+{
+	SHARED_P_IF_CONSTEXPR (is_trivially_relocatable<T>::value)
+	{
+		std::memcpy(static_cast<void*>(aDest), static_cast<const void*>(aSource), aCount * sizeof(T));
+		return;
+	}
+
+	for (std::size_t i = 0; i < aCount; ++i)
+	{
+		new (aDest + i) T(std::move(aSource[i]));
+		aSource[i].~T();
+	}
+}
+
+// swap overload, found by argument dependent lookup (so std::sort, std::swap etc. exchange handles without touching counts)
+template <typename T, typename Policy>
+inline void swap(shared_p<T, Policy>& aLeft, shared_p<T, Policy>& aRight) noexcept
+{
+	aLeft.swap(aRight);
+}
+
+template<typename T, typename Policy>
+inline constexpr weak_p<T, Policy>::weak_p() noexcept
+	: iObject(nullptr), iControlBlock(nullptr)
+{
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>::weak_p(const shared_p<T, Policy>& aShared) noexcept
+	: iObject(aShared.iObject), iControlBlock(aShared.iControlBlock)
+{
+	if (iControlBlock)
+	{
+		iControlBlock->iCount.add_weak();
+	}
+}
+
+template<typename T, typename Policy>
+template<typename U, typename>
+inline weak_p<T, Policy>::weak_p(const shared_p<U, Policy>& aShared) noexcept
+	: iObject(aShared.iObject), iControlBlock(aShared.iControlBlock)
+{
+	if (iControlBlock)
+	{
+		iControlBlock->iCount.add_weak();
+	}
+}
+
+template<typename T, typename Policy>
+template<typename U>
+inline weak_p<T, Policy>::weak_p(const shared_p<U, Policy>& aShared, T* aObject) noexcept
+	: iObject(aObject), iControlBlock(aShared.iControlBlock)
+{
+	if (iControlBlock)
+	{
+		iControlBlock->iCount.add_weak();
+	}
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>::weak_p(const weak_p& aOther) noexcept
+	: iObject(aOther.iObject), iControlBlock(aOther.iControlBlock)
+{
+	if (iControlBlock)
+	{
+		iControlBlock->iCount.add_weak();
+	}
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>::weak_p(weak_p&& aOther) noexcept
+	: iObject(aOther.iObject), iControlBlock(aOther.iControlBlock)
+{
+	aOther.iObject = nullptr;
+	aOther.iControlBlock = nullptr;
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>& weak_p<T, Policy>::operator=(const weak_p& aOther) noexcept
+{
+	weak_p<T, Policy>(aOther).swap(*this);
+	return *this;
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>& weak_p<T, Policy>::operator=(weak_p&& aOther) noexcept
+{
+	weak_p<T, Policy>(std::move(aOther)).swap(*this);
+	return *this;
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>& weak_p<T, Policy>::operator=(const shared_p<T, Policy>& aShared) noexcept
+{
+	weak_p<T, Policy>(aShared).swap(*this);
+	return *this;
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy>::~weak_p()
+{
+	if (iControlBlock && iControlBlock->iCount.release_weak())
+	{
+		// the object is already gone (the shared_p's weak count has been released), so just free the block
+		iControlBlock->destroy();
+	}
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> weak_p<T, Policy>::lock() const noexcept
+{
+	if (iControlBlock && iControlBlock->iCount.add_ref_if_nonzero())
+	{
+		return shared_p<T, Policy>(iControlBlock, iObject);
+	}
+	return shared_p<T, Policy>();
+}
+
+template<typename T, typename Policy>
+inline bool weak_p<T, Policy>::expired() const noexcept
+{
+	return count() == 0;
+}
+
+template<typename T, typename Policy>
+inline typename shared_p_count<Policy>::type weak_p<T, Policy>::count() const noexcept
+{
+	return iControlBlock ? iControlBlock->iCount.use_count() : 0;
+}
+
+template<typename T, typename Policy>
+inline void weak_p<T, Policy>::swap(weak_p& aOther) noexcept
+{
+	using std::swap;
+	swap(iObject, aOther.iObject);
+	swap(iControlBlock, aOther.iControlBlock);
+}
+
+template <typename T, typename Policy>
+inline void swap(weak_p<T, Policy>& aLeft, weak_p<T, Policy>& aRight) noexcept
+{
+	aLeft.swap(aRight);
+}
+
+/*
+ * enable_shared_p_from_this - a base which lets an object managed by shared_p make more shared_p's to itself.
+ *
+ * When make, make_shared (or allocate_shared, make_pooled, make_deferred) creates a T which derives from
+ * enable_shared_p_from_this<T, Policy>, it fills in the base's weak_p with the new control block. shared_from_this()
+ * then shares that block: one count added, no allocation, and never a second block (which would destroy the object
+ * twice). The object must be managed by a shared_p with the same Policy; otherwise, and while the object is being
+ * constructed or destroyed, shared_from_this() returns an empty shared_p.
+ *
+ * Example usage:
+ *
+ * 		class Connection : public enable_shared_p_from_this<Connection>
+ * 		{
+ * 			void read() { iSocket.async_read(iBuffer, Callback(shared_from_this())); }   (keeps the Connection alive)
+ * 		};
+ * 		shared_p<Connection> connection = shared_p<Connection>::make(socket);
+ */
+template <typename T, typename Policy>
+class enable_shared_p_from_this
+{
+public:
+	// A shared_p sharing ownership of this object (empty if no shared_p owns it)
+	SHARED_P_NODISCARD shared_p<T, Policy> shared_from_this();
+	SHARED_P_NODISCARD shared_p<const T, Policy> shared_from_this() const;
+
+	// A weak_p to this object (empty if no shared_p owns it)
+	SHARED_P_NODISCARD weak_p<T, Policy> weak_from_this() const noexcept;
+
+protected:
+	enable_shared_p_from_this() noexcept { }
+
+	// Copying the object doesn't copy its ownership: the copy is linked to its own shared_p, if it gets one
+	enable_shared_p_from_this(const enable_shared_p_from_this&) noexcept { }
+	enable_shared_p_from_this& operator=(const enable_shared_p_from_this&) noexcept { return *this; }
+
+	~enable_shared_p_from_this() { }
+
+private:
+	template <typename U, typename P, typename V>
+	friend void shared_p_enable_from_this(const shared_p<U, P>& aOwner, const enable_shared_p_from_this<V, P>* aBase) noexcept;
+
+	// Holds a weak count on the block (not a strong one, which would keep the object alive forever)
+	mutable weak_p<T, Policy> iWeakThis;
+};
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> enable_shared_p_from_this<T, Policy>::shared_from_this()
+{
+	return iWeakThis.lock();
+}
+
+template<typename T, typename Policy>
+inline shared_p<const T, Policy> enable_shared_p_from_this<T, Policy>::shared_from_this() const
+{
+	return iWeakThis.lock();
+}
+
+template<typename T, typename Policy>
+inline weak_p<T, Policy> enable_shared_p_from_this<T, Policy>::weak_from_this() const noexcept
+{
+	return iWeakThis;
+}
+
+template <typename T, typename Policy, typename U>
+inline void shared_p_enable_from_this(const shared_p<T, Policy>& aOwner, const enable_shared_p_from_this<U, Policy>* aBase) noexcept
+{
+	// an object which is already shared keeps its first owner
+	if (aBase && aBase->iWeakThis.expired())
+	{
+		// the owner may be a shared_p<const U>, but the object itself was created non-const
+		aBase->iWeakThis = weak_p<U, Policy>(aOwner, const_cast<U*>(static_cast<const U*>(aBase)));
+	}
+}
+
+template <typename T, typename Policy>
+inline void shared_p_enable_from_this(const shared_p<T, Policy>&, ...) noexcept
+{
+}
+
+/*
+ * borrowed_p - a non-owning view of an object, borrowed from a shared_p which outlives it.
+ *
+ * Passing a borrowed_p down a call chain copies two pointers and touches no count (no atomic operations at any
+ * depth), where passing a shared_p by value would add and release a count at every hop. It still carries the
+ * shared identity of the object, so promote() can turn it back into a shared_p (one count added) when ownership
+ * really does need to escape - to be stored, or handed to another thread.
+ *
+ * A borrowed_p is only valid while the shared_p it was borrowed from holds the object, so it is for parameters
+ * and locals only: it can't be made from a temporary shared_p, assigned, or allocated on the heap.
+ *
+ * Example usage:
+ *
+ * 		void handle(borrowed_p<Request> aRequest)
+ * 		{
+ * 			parse(aRequest);                          (no count changes)
+ * 			if (slow(aRequest->iPath))
+ * 			{
+ * 				backlog.push(aRequest.promote());     (now shared, and may outlive the caller's shared_p)
+ * 			}
+ * 		}
+ * 		...
+ * 		handle(request);                              (request is a shared_p<Request>)
+ */
+template <typename T, typename Policy>
+class borrowed_p
+{
+public:
+	// Borrows aOwner's object (an empty borrowed_p if aOwner is empty). aOwner must outlive the borrowed_p.
+	borrowed_p(const shared_p<T, Policy>& aOwner) noexcept;
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	borrowed_p(const shared_p<U, Policy>& aOwner) noexcept;
+
+	// Not from a temporary (it would be gone before the borrowed_p was used)
+	borrowed_p(const shared_p<T, Policy>&& aOwner) = delete;
+	template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+	borrowed_p(const shared_p<U, Policy>&& aOwner) = delete;
+
+	borrowed_p(const borrowed_p& aOther) noexcept = default;
+
+	// Not storable: a borrowed_p can't be reassigned, or allocated on the heap
+	borrowed_p& operator=(const borrowed_p& aOther) = delete;
+	static void* operator new(std::size_t aSize) = delete;
+	static void* operator new[](std::size_t aSize) = delete;
+
+	// A shared_p to the object, which shares ownership with the shared_p this was borrowed from (empty if this is empty)
+	SHARED_P_NODISCARD shared_p<T, Policy> promote() const noexcept(shared_p_nothrow_copy<Policy>::value);
+
+	// How many shared_p's reference the object? (0 for an empty borrowed_p)
+	SHARED_P_NODISCARD typename shared_p_count<Policy>::type count() const noexcept;
+
+	// As for shared_p (the object remains under shared_p management)
+	operator T&() const noexcept;
+	T& get() const noexcept;
+	T* operator->() const noexcept;
+	T& operator*() const noexcept;
+
+	// Does this borrowed_p refer to an object?
+	explicit operator bool() const noexcept;
+
+private:
+	T* iObject;
+	shared_ctrl_block<Policy>* iControlBlock;
+};
+
+template<typename T, typename Policy>
+inline borrowed_p<T, Policy>::borrowed_p(const shared_p<T, Policy>& aOwner) noexcept
+	: iObject(aOwner.iObject), iControlBlock(aOwner.iControlBlock)
+{
+}
+
+template<typename T, typename Policy>
+template<typename U, typename>
+inline borrowed_p<T, Policy>::borrowed_p(const shared_p<U, Policy>& aOwner) noexcept
+	: iObject(aOwner.iObject), iControlBlock(aOwner.iControlBlock)
+{
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> borrowed_p<T, Policy>::promote() const noexcept(shared_p_nothrow_copy<Policy>::value)
+{
+	if (!iControlBlock)
+	{
+		return shared_p<T, Policy>();
+	}
+
+	// the lender still holds a count, so the object is alive and the count can just be added to
+	iControlBlock->iCount.add_ref();
+	SHARED_P_INSTRUMENT(copy<T>(1));
+	return shared_p<T, Policy>(iControlBlock, iObject);
+}
+
+template<typename T, typename Policy>
+inline typename shared_p_count<Policy>::type borrowed_p<T, Policy>::count() const noexcept
+{
+	return iControlBlock ? iControlBlock->iCount.use_count() : 0;
+}
+
+template<typename T, typename Policy>
+inline borrowed_p<T, Policy>::operator T&() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T, typename Policy>
+inline T& borrowed_p<T, Policy>::get() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T, typename Policy>
+inline T* borrowed_p<T, Policy>::operator->() const noexcept
+{
+	return iObject;
+}
+
+template<typename T, typename Policy>
+inline T& borrowed_p<T, Policy>::operator*() const noexcept
+{
+	return *iObject;
+}
+
+template<typename T, typename Policy>
+inline borrowed_p<T, Policy>::operator bool() const noexcept
+{
+	return iObject != nullptr;
+}
+
+/*
+ * shared_p<T[]> - a shared array, with a size.
+ *
+ * Shares and counts exactly as shared_p<T> does (copies share one control block). make_shared adopts an array
+ * allocated with new T[], and frees it with delete[]. make (or make_shared_array) allocates the control block
+ * and the elements together, with the elements starting on a cache line boundary.
+ *
+ * Example usage:
+ *
+ * 		shared_p<float[]> samples = make_shared_array<float>(1024);
+ * 		samples[0] = 1.0f;
+ * 		kernel(samples.data(), samples.size());
+ */
+template <typename T, typename Policy>
+class shared_p<T[], Policy>
+{
+public:
+	// Empty (null) shared array - size() and count() are 0
+	constexpr shared_p() noexcept;
+	constexpr shared_p(std::nullptr_t) noexcept;
+
+	/* Public constructor (static) - takes ownership of aArray, of aSize elements, which is deleted with delete[]
+
+	    Usage:	shared_p<int[]>::make_shared(new int[aSize], aSize)
+	*/
+	SHARED_P_NODISCARD static shared_p make_shared(T*&& aArray, std::size_t aSize);
+
+	/* Public constructor (static, in-place) - aSize value-initialised elements, in the same allocation as the control block
+
+	    Usage:	shared_p<int[]>::make(aSize)
+	*/
+	SHARED_P_NODISCARD static shared_p make(std::size_t aSize);
+
+	void swap(shared_p& aOther) noexcept;
+
+	// How many shared_p's reference this array? (0 for an empty shared_p)
+	SHARED_P_NODISCARD typename shared_p_count<Policy>::type count() const noexcept;
+
+	// The number of elements
+	SHARED_P_NODISCARD std::size_t size() const noexcept;
+
+	// The first element (nullptr for an empty shared_p)
+	T* data() const noexcept;
+
+	// Element access (unchecked)
+	T& operator[](std::size_t aIndex) const noexcept;
+
+	// Does this shared_p hold an array? (false if empty or moved-from)
+	explicit operator bool() const noexcept;
+
+private:
+	shared_p(shared_p<T, Policy>&& aElements, std::size_t aSize);
+
+	// Counts and owns the elements (copying, moving and destroying this just copies, moves or destroys iElements)
+	shared_p<T, Policy> iElements;
+
+	std::size_t iSize;
+};
+
+template<typename T, typename Policy>
+inline constexpr shared_p<T[], Policy>::shared_p() noexcept
+	: iSize(0)
+{
+}
+
+template<typename T, typename Policy>
+inline constexpr shared_p<T[], Policy>::shared_p(std::nullptr_t) noexcept
+	: iSize(0)
+{
+}
+
+template<typename T, typename Policy>
+inline shared_p<T[], Policy>::shared_p(shared_p<T, Policy>&& aElements, std::size_t aSize)
+	: iElements(std::move(aElements)), iSize(aSize)
+{
+}
+
+template<typename T, typename Policy>
+inline shared_p<T[], Policy> shared_p<T[], Policy>::make_shared(T*&& aArray, std::size_t aSize)
+{
+	return shared_p<T[], Policy>(shared_p<T, Policy>::make_shared(std::move(aArray), std::default_delete<T[]>()), aSize);
+}
+
+template<typename T, typename Policy>
+inline shared_p<T[], Policy> shared_p<T[], Policy>::make(std::size_t aSize)
+{
+	shared_array_block<T, Policy>* block = shared_array_block<T, Policy>::create(aSize);
+	return shared_p<T[], Policy>(shared_p<T, Policy>(block, block->elements()), aSize);
+}
+
+template<typename T, typename Policy>
+inline void shared_p<T[], Policy>::swap(shared_p& aOther) noexcept
+{
+	using std::swap;
+	iElements.swap(aOther.iElements);
+	swap(iSize, aOther.iSize);
+}
+
+template<typename T, typename Policy>
+inline typename shared_p_count<Policy>::type shared_p<T[], Policy>::count() const noexcept
+{
+	return iElements.count();
+}
+
+template<typename T, typename Policy>
+inline std::size_t shared_p<T[], Policy>::size() const noexcept
+{
+	return iSize;
+}
+
+template<typename T, typename Policy>
+inline T* shared_p<T[], Policy>::data() const noexcept
+{
+	return iElements.iObject;
+}
+
+template<typename T, typename Policy>
+inline T& shared_p<T[], Policy>::operator[](std::size_t aIndex) const noexcept
+{
+	return iElements.iObject[aIndex];
+}
+
+template<typename T, typename Policy>
+inline shared_p<T[], Policy>::operator bool() const noexcept
+{
+	return static_cast<bool>(iElements);
+}
+
+/* Free function equivalent of shared_p<T, Policy>::make (single allocation, T constructed in place).
+
+    Usage:	shared_p<MyType> sp = make_shared_p<MyType>(5);
+    	shared_p<MyType, unsynchronized_policy> local = make_shared_p<MyType, unsynchronized_policy>(5);
+*/
+template<typename T, typename Policy = atomic_policy, typename... Args>
+SHARED_P_NODISCARD inline shared_p<T, Policy> make_shared_p(Args&&... aArgs)
+{
+	return shared_p<T, Policy>::make(std::forward<Args>(aArgs)...);
+}
+
+/* Free function equivalent of shared_p<T, Policy>::allocate_shared (control block storage from aAlloc).
+
+    Usage:	shared_p<MyType> sp = allocate_shared_p<MyType>(myArenaAllocator, 5);
+*/
+template<typename T, typename Policy = atomic_policy, typename Alloc, typename... Args>
+SHARED_P_NODISCARD inline shared_p<T, Policy> allocate_shared_p(const Alloc& aAlloc, Args&&... aArgs)
+{
+	return shared_p<T, Policy>::allocate_shared(aAlloc, std::forward<Args>(aArgs)...);
+}
+
+/* Free function equivalent of shared_p<T[], Policy>::make (aSize elements, inline after the control block, cache line aligned).
+
+    Usage:	shared_p<float[]> samples = make_shared_array<float>(1024);
+*/
+template<typename T, typename Policy = atomic_policy>
+SHARED_P_NODISCARD inline shared_p<T[], Policy> make_shared_array(std::size_t aSize)
+{
+	return shared_p<T[], Policy>::make(aSize);
+}
+
+/* Pointer casts - the shared_p equivalents of static_cast / dynamic_cast / const_cast.
+   The result shares aOther's control block (no allocation, just one more count), and keeps the object alive.
+   dynamic_pointer_cast returns an empty shared_p if the cast fails.
+
+    Usage:	shared_p<Base> base = make_shared_p<Derived>(5);
+    	shared_p<Derived> derived = dynamic_pointer_cast<Derived>(base);
+*/
+template<typename T, typename U, typename Policy>
+inline shared_p<T, Policy> static_pointer_cast(const shared_p<U, Policy>& aOther)
+{
+	return shared_p<T, Policy>(aOther, static_cast<T*>(aOther.iObject));
+}
+
+template<typename T, typename U, typename Policy>
+inline shared_p<T, Policy> dynamic_pointer_cast(const shared_p<U, Policy>& aOther)
+{
+	if (T* object = dynamic_cast<T*>(aOther.iObject))
+	{
+		return shared_p<T, Policy>(aOther, object);
+	}
+	return shared_p<T, Policy>();
+}
+
+template<typename T, typename U, typename Policy>
+inline shared_p<T, Policy> const_pointer_cast(const shared_p<U, Policy>& aOther)
+{
+	return shared_p<T, Policy>(aOther, const_cast<T*>(aOther.iObject));
+}
@@ -0,0 +1,248 @@
+#include "shared_p.hpp"
+#include "benchmark/benchmark.h"
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/*
+ * shared_p benchmarks (google/benchmark).
+ *
+ * Compares shared_p with std::shared_ptr (made with new, and with std::make_shared) and std::unique_ptr on each
+ * hot operation - make and destroy, copy, move, get - across object sizes, and copy throughput across threads.
+ *
+ * Build and run with:  make shared_p_bench && ./shared_p_bench
+ * 	(or a subset, e.g. ./shared_p_bench --benchmark_filter=BM_Copy)
+ *
+ * NB: libstdc++'s shared_ptr uses plain (non-atomic) counts until the program starts a second thread, so
+ * std::shared_ptr's single-threaded copy numbers are only comparable once a threaded benchmark has run
+ * (e.g. with --benchmark_filter=Contended|Copy).
+ */
+
+enum { kMaxThreads = 8 };
+
+// The managed object: Size bytes
+template <std::size_t Size>
+struct payload
+{
+	char iBytes[Size];
+};
+
+/*
+ * Makers - each handle type, made the way it usually is. A maker provides:
+ *   handle        - the handle type
+ *   handle make() - a handle to a new (value-initialised) T
+ */
+template <typename T>
+struct shared_p_make
+{
+	typedef shared_p<T> handle;
+	static handle make() { return shared_p<T>::make(); }
+};
+
+template <typename T>
+struct shared_p_new
+{
+	typedef shared_p<T> handle;
+	static handle make() { return shared_p<T>::make_shared(new T()); }
+};
+
+template <typename T>
+struct shared_p_pooled
+{
+	typedef shared_p<T> handle;
+	static handle make() { return shared_p<T>::make_pooled(); }
+};
+
+template <typename T>
+struct shared_p_biased
+{
+	typedef shared_p<T, biased_policy> handle;
+	static handle make() { return shared_p<T, biased_policy>::make(); }
+};
+
+template <typename T>
+struct shared_p_sharded
+{
+	typedef shared_p<T, sharded_policy<> > handle;
+	static handle make() { return shared_p<T, sharded_policy<> >::make(); }
+};
+
+template <typename T>
+struct std_make_shared
+{
+	typedef std::shared_ptr<T> handle;
+	static handle make() { return std::make_shared<T>(); }
+};
+
+template <typename T>
+struct std_shared_ptr_new
+{
+	typedef std::shared_ptr<T> handle;
+	static handle make() { return std::shared_ptr<T>(new T()); }
+};
+
+template <typename T>
+struct std_unique_ptr
+{
+	typedef std::unique_ptr<T> handle;
+	static handle make() { return std::unique_ptr<T>(new T()); }
+};
+
+// Registers bench for maker, for small, cache line and large objects
+#define SHARED_P_BENCH_SIZES(bench, maker) \
+	BENCHMARK_TEMPLATE(bench, maker<payload<8> >); \
+	BENCHMARK_TEMPLATE(bench, maker<payload<64> >); \
+	BENCHMARK_TEMPLATE(bench, maker<payload<1024> >)
+
+// Make an object and destroy it (the allocation(s), construction, and the final release)
+template <typename Maker>
+static void BM_MakeAndDestroy(benchmark::State& aState)
+{
+	for (auto _ : aState)
+	{
+		typename Maker::handle made = Maker::make();
+		benchmark::DoNotOptimize(made);
+	}
+}
+SHARED_P_BENCH_SIZES(BM_MakeAndDestroy, shared_p_make);
+SHARED_P_BENCH_SIZES(BM_MakeAndDestroy, shared_p_new);
+SHARED_P_BENCH_SIZES(BM_MakeAndDestroy, shared_p_pooled);
+SHARED_P_BENCH_SIZES(BM_MakeAndDestroy, std_make_shared);
+SHARED_P_BENCH_SIZES(BM_MakeAndDestroy, std_shared_ptr_new);
+SHARED_P_BENCH_SIZES(BM_MakeAndDestroy, std_unique_ptr);
+
+// Copy a handle and destroy the copy (one increment, one decrement)
+template <typename Maker>
+static void BM_Copy(benchmark::State& aState)
+{
+	typename Maker::handle original = Maker::make();
+	for (auto _ : aState)
+	{
+		typename Maker::handle copy = original;
+		benchmark::DoNotOptimize(copy);
+	}
+}
+SHARED_P_BENCH_SIZES(BM_Copy, shared_p_make);
+SHARED_P_BENCH_SIZES(BM_Copy, shared_p_biased);
+SHARED_P_BENCH_SIZES(BM_Copy, std_make_shared);
+
+// Move a handle out and back (no counts change)
+template <typename Maker>
+static void BM_Move(benchmark::State& aState)
+{
+	typename Maker::handle original = Maker::make();
+	for (auto _ : aState)
+	{
+		typename Maker::handle moved = std::move(original);
+		benchmark::DoNotOptimize(moved);
+		original = std::move(moved);
+	}
+}
+SHARED_P_BENCH_SIZES(BM_Move, shared_p_make);
+SHARED_P_BENCH_SIZES(BM_Move, std_make_shared);
+SHARED_P_BENCH_SIZES(BM_Move, std_unique_ptr);
+
+// Reach the object through the handle
+template <typename Maker>
+static void BM_Get(benchmark::State& aState)
+{
+	typename Maker::handle original = Maker::make();
+	for (auto _ : aState)
+	{
+		benchmark::DoNotOptimize(&*original);
+	}
+}
+SHARED_P_BENCH_SIZES(BM_Get, shared_p_make);
+SHARED_P_BENCH_SIZES(BM_Get, std_make_shared);
+SHARED_P_BENCH_SIZES(BM_Get, std_unique_ptr);
+
+// One object, shared by every benchmark thread
+template <typename Maker>
+static typename Maker::handle& contended()
+{
+	static typename Maker::handle object = Maker::make();
+	return object;
+}
+
+// Every thread copies the same object - all threads increment and decrement one count
+template <typename Maker>
+static void BM_ContendedCopy(benchmark::State& aState)
+{
+	typename Maker::handle& shared = contended<Maker>();
+	for (auto _ : aState)
+	{
+		typename Maker::handle copy = shared;
+		benchmark::DoNotOptimize(copy);
+	}
+}
+BENCHMARK_TEMPLATE(BM_ContendedCopy, shared_p_make<payload<8> >)->ThreadRange(1, kMaxThreads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ContendedCopy, shared_p_sharded<payload<8> >)->ThreadRange(1, kMaxThreads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_ContendedCopy, std_make_shared<payload<8> >)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+// Hand one object to 64 consumers and take it back: share_n / release_n (two count operations) against 64 copies
+static void BM_BroadcastShareN(benchmark::State& aState)
+{
+	shared_p<int> packet = make_shared_p<int>(1);
+	std::vector<shared_p<int> > queues(64);
+	for (auto _ : aState)
+	{
+		packet.share_n(queues.size(), queues.begin());
+		shared_p<int>::release_n(queues.begin(), queues.size());
+	}
+}
+BENCHMARK(BM_BroadcastShareN);
+
+static void BM_BroadcastCopies(benchmark::State& aState)
+{
+	shared_p<int> packet = make_shared_p<int>(1);
+	std::vector<shared_p<int> > queues(64);
+	for (auto _ : aState)
+	{
+		for (std::size_t i = 0; i < queues.size(); ++i)
+		{
+			queues[i] = packet;
+		}
+		for (std::size_t i = 0; i < queues.size(); ++i)
+		{
+			queues[i] = nullptr;
+		}
+	}
+}
+BENCHMARK(BM_BroadcastCopies);
+
+// One object per benchmark thread, allocated back to back, so unpadded control blocks end up sharing cache lines
+template <typename Policy>
+static std::vector<shared_p<int, Policy> > make_neighbours()
+{
+	std::vector<shared_p<int, Policy> > objects;
+	for (int i = 0; i < kMaxThreads; ++i)
+	{
+		objects.push_back(shared_p<int, Policy>::make(i));
+	}
+	return objects;
+}
+
+template <typename Policy>
+static std::vector<shared_p<int, Policy> >& neighbours()
+{
+	static std::vector<shared_p<int, Policy> > objects = make_neighbours<Policy>();
+	return objects;
+}
+
+// Each thread copies and destroys its own object - no logical sharing, so any slowdown
+// as threads are added is false sharing between neighbouring counts
+template <typename Policy>
+static void BM_UnrelatedCopies(benchmark::State& aState)
+{
+	shared_p<int, Policy>& mine = neighbours<Policy>()[aState.thread_index()];
+	for (auto _ : aState)
+	{
+		shared_p<int, Policy> copy = mine;
+		benchmark::DoNotOptimize(copy);
+	}
+}
+BENCHMARK_TEMPLATE(BM_UnrelatedCopies, atomic_policy)->ThreadRange(1, kMaxThreads)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_UnrelatedCopies, padded_policy<>)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,353 @@
+#pragma once
+#include "shared_p.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * shared_p_epoch - epoch based reclamation, for objects read far more often than they are replaced.
+ *
+ * A reader pins the current epoch with a shared_p_epoch::guard, and may then read any epoch_p without touching a
+ * reference count: no read-modify-write on a shared cache line, however many threads are reading. When a writer
+ * replaces the value of an epoch_p, the old value is retired rather than released: its shared_p is kept (so its
+ * count, and its object, stay alive) until every thread which was reading when it was replaced has left its
+ * guard. Only then is the shared_p released - destroying the object, if that was its last count.
+ *
+ * Entering a guard costs one store to the thread's own (padded) record; guards nest, and only the outermost one
+ * pins. Writers pay an allocation per store, and a scan of every reading thread's record to reclaim what is safe.
+ * A thread should not keep a guard for long: nothing retired after it entered can be reclaimed until it leaves.
+ * Each store reclaims what has become safe so far; call reclaim() to release the rest once readers have moved on
+ * (e.g. after the last store, or periodically).
+ *
+ * Example usage:
+ *
+ * 		epoch_p<Table> gRoutes(shared_p<Table>::make(load()));
+ *
+ * 		void route(const Request& aRequest)            (readers, on any number of threads)
+ * 		{
+ * 			shared_p_epoch::guard pinned;
+ * 			const Table* table = gRoutes.get(pinned);  (no count change; valid until pinned goes)
+ * 			forward(aRequest, table->find(aRequest.iPath));
+ * 		}
+ *
+ * 		gRoutes.store(shared_p<Table>::make(reload()));  (the old Table is destroyed once no reader can see it)
+ */
+class shared_p_epoch
+{
+private:
+	struct record;
+
+public:
+	// Pins the calling thread's epoch for its lifetime (values read through an epoch_p stay alive until it goes)
+	class guard
+	{
+	public:
+		guard();
+		~guard();
+
+		guard(const guard&) = delete;
+		guard& operator=(const guard&) = delete;
+
+	private:
+		record& iRecord;
+	};
+
+	// Something retired, to be released once no reader can still see it
+	struct retired
+	{
+		retired() : iEpoch(0), iNext(nullptr) { }
+		virtual ~retired() { }
+
+		// The epoch it was retired in
+		std::uint64_t iEpoch;
+		retired* iNext;
+	};
+
+	// A retired shared_p (keeps its count until it is deleted)
+	template <typename T, typename Policy>
+	struct retired_value : retired
+	{
+		explicit retired_value(shared_p<T, Policy>&& aValue) : iValue(std::move(aValue)) { }
+
+		shared_p<T, Policy> iValue;
+	};
+
+	// Keeps aValue's count until every reader which might see its object has left its guard
+	template <typename T, typename Policy>
+	static void retire(shared_p<T, Policy> aValue);
+
+	// Retires aItem (which is deleted once it is safe), and reclaims whatever is already safe
+	static void retire(retired* aItem);
+
+	// Releases everything retired that no reader can still see, on the calling thread. Returns how many were released.
+	static std::size_t reclaim();
+
+	// How many retired values are still waiting for readers to move on?
+	static std::size_t pending();
+
+private:
+	// One reading thread's epoch (0 while it is not in a guard), on a cache line of its own
+	struct record
+	{
+		record() : iEpoch(0), iDepth(0), iInUse(true), iNext(nullptr) { }
+
+		char iLeading[shared_p_cache_line];
+		std::atomic<std::uint64_t> iEpoch;
+
+		// Guards open on the owning thread (only it reads or writes this)
+		int iDepth;
+
+		// Is a thread using this record? (records are reused once their thread exits, and never freed)
+		std::atomic<bool> iInUse;
+		record* iNext;
+		char iTrailing[shared_p_cache_line];
+	};
+
+	// Gives the thread's record back when the thread exits
+	struct thread_record
+	{
+		thread_record();
+		~thread_record();
+
+		record* iRecord;
+	};
+
+	struct state
+	{
+		state() : iEpoch(1), iRecords(nullptr), iRetired(nullptr), iPending(0) { }
+
+		std::atomic<std::uint64_t> iEpoch;
+		std::atomic<record*> iRecords;
+
+		std::mutex iMutex;
+		retired* iRetired;
+		std::size_t iPending;
+	};
+
+	static record& local();
+	static state& global();
+};
+
+/*
+ * epoch_p - a shared_p which readers can see without counting, inside a shared_p_epoch::guard.
+ *
+ * get() gives the current object as a plain pointer, valid until the guard goes; load() gives a shared_p to it
+ * (one count added), for a reader which needs to keep it. store() publishes a new value, and retires the old one
+ * (see shared_p_epoch). Any number of threads may read and store concurrently.
+ */
+template <typename T, typename Policy = atomic_policy>
+class epoch_p
+{
+public:
+	epoch_p() noexcept;
+	explicit epoch_p(shared_p<T, Policy> aValue);
+	~epoch_p();
+
+	epoch_p(const epoch_p&) = delete;
+	epoch_p& operator=(const epoch_p&) = delete;
+
+	// The current object (nullptr if empty), without touching its count. Valid until aGuard goes.
+	T* get(const shared_p_epoch::guard& aGuard) const noexcept;
+
+	// A shared_p to the current object (one count added; empty if this is empty)
+	shared_p<T, Policy> load() const;
+
+	// Publishes aValue, and retires the value it replaces
+	void store(shared_p<T, Policy> aValue);
+
+private:
+	// A published value, retired (and deleted by shared_p_epoch) once it has been replaced
+	typedef shared_p_epoch::retired_value<T, Policy> node;
+
+	// The published value (nullptr when empty); nodes are only deleted through shared_p_epoch::retire
+	std::atomic<node*> iNode;
+};
+
+inline shared_p_epoch::guard::guard()
+	: iRecord(local())
+{
+	if (iRecord.iDepth++ == 0)
+	{
+		// seq_cst, so the epoch is visible to a reclaiming thread before any pointer this guard reads
+		iRecord.iEpoch.store(global().iEpoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	}
+}
+
+inline shared_p_epoch::guard::~guard()
+{
+	if (--iRecord.iDepth == 0)
+	{
+		iRecord.iEpoch.store(0, std::memory_order_release);
+	}
+}
+
+template <typename T, typename Policy>
+inline void shared_p_epoch::retire(shared_p<T, Policy> aValue)
+{
+	if (aValue)
+	{
+		retire(new retired_value<T, Policy>(std::move(aValue)));
+	}
+}
+
+inline void shared_p_epoch::retire(retired* aItem)
+{
+	state& domain = global();
+
+	// readers pinned at or before this epoch may still see aItem; readers pinned after it can't
+	aItem->iEpoch = domain.iEpoch.fetch_add(1, std::memory_order_seq_cst);
+	{
+		std::lock_guard<std::mutex> lock(domain.iMutex);
+		aItem->iNext = domain.iRetired;
+		domain.iRetired = aItem;
+		++domain.iPending;
+	}
+	reclaim();
+}
+
+inline std::size_t shared_p_epoch::reclaim()
+{
+	state& domain = global();
+
+	// the oldest epoch still pinned: everything retired before it is safe. Starting from the current epoch leaves
+	// out anything retired once the scan has begun (its readers may have pinned before the scan, unseen by it).
+	std::uint64_t oldest = domain.iEpoch.load(std::memory_order_seq_cst);
+	for (record* reader = domain.iRecords.load(std::memory_order_acquire); reader; reader = reader->iNext)
+	{
+		std::uint64_t epoch = reader->iEpoch.load(std::memory_order_seq_cst);
+		if (epoch != 0 && epoch < oldest)
+		{
+			oldest = epoch;
+		}
+	}
+
+	retired* safe = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(domain.iMutex);
+		retired** link = &domain.iRetired;
+		while (*link)
+		{
+			retired* item = *link;
+			if (item->iEpoch < oldest)
+			{
+				*link = item->iNext;
+				item->iNext = safe;
+				safe = item;
+				--domain.iPending;
+			}
+			else
+			{
+				link = &item->iNext;
+			}
+		}
+	}
+
+	// released without the lock, as a destructor may retire something itself
+	std::size_t released = 0;
+	while (safe)
+	{
+		retired* next = safe->iNext;
+		delete safe;
+		safe = next;
+		++released;
+	}
+	return released;
+}
+
+inline std::size_t shared_p_epoch::pending()
+{
+	state& domain = global();
+	std::lock_guard<std::mutex> lock(domain.iMutex);
+	return domain.iPending;
+}
+
+inline shared_p_epoch::thread_record::thread_record()
+	: iRecord(nullptr)
+{
+	state& domain = global();
+
+	// reuse the record of a thread which has exited, if there is one
+	for (record* reader = domain.iRecords.load(std::memory_order_acquire); reader; reader = reader->iNext)
+	{
+		bool free = false;
+		if (!reader->iInUse.load(std::memory_order_relaxed) && reader->iInUse.compare_exchange_strong(free, true, std::memory_order_acquire))
+		{
+			iRecord = reader;
+			return;
+		}
+	}
+
+	iRecord = new record();
+	iRecord->iNext = domain.iRecords.load(std::memory_order_relaxed);
+	while (!domain.iRecords.compare_exchange_weak(iRecord->iNext, iRecord, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+inline shared_p_epoch::thread_record::~thread_record()
+{
+	iRecord->iInUse.store(false, std::memory_order_release);
+}
+
+inline shared_p_epoch::record& shared_p_epoch::local()
+{
+	static thread_local thread_record mine;
+	return *mine.iRecord;
+}
+
+inline shared_p_epoch::state& shared_p_epoch::global()
+{
+	// never destroyed: values may be retired (and records given back) while static objects are destroyed
+	static state* domain = new state();
+	return *domain;
+}
+
+template<typename T, typename Policy>
+inline epoch_p<T, Policy>::epoch_p() noexcept
+	: iNode(nullptr)
+{
+}
+
+template<typename T, typename Policy>
+inline epoch_p<T, Policy>::epoch_p(shared_p<T, Policy> aValue)
+	: iNode(aValue ? new node(std::move(aValue)) : nullptr)
+{
+}
+
+template<typename T, typename Policy>
+inline epoch_p<T, Policy>::~epoch_p()
+{
+	// readers may still be looking at the last value
+	node* last = iNode.load(std::memory_order_relaxed);
+	if (last)
+	{
+		shared_p_epoch::retire(last);
+	}
+}
+
+template<typename T, typename Policy>
+inline T* epoch_p<T, Policy>::get(const shared_p_epoch::guard&) const noexcept
+{
+	node* current = iNode.load(std::memory_order_seq_cst);
+	return current ? &current->iValue.get() : nullptr;
+}
+
+template<typename T, typename Policy>
+inline shared_p<T, Policy> epoch_p<T, Policy>::load() const
+{
+	// the guard keeps the node (and so its count) alive while the copy is made
+	shared_p_epoch::guard pinned;
+	node* current = iNode.load(std::memory_order_seq_cst);
+	return current ? current->iValue : shared_p<T, Policy>();
+}
+
+template<typename T, typename Policy>
+inline void epoch_p<T, Policy>::store(shared_p<T, Policy> aValue)
+{
+	node* replaced = iNode.exchange(aValue ? new node(std::move(aValue)) : nullptr, std::memory_order_seq_cst);
+	if (replaced)
+	{
+		shared_p_epoch::retire(replaced);
+	}
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+/*
+ * shared_p_instrumentation - per-type counters of shared_p activity, compiled in only when
+ * SHARED_P_INSTRUMENTATION is defined (shared_p.hpp includes this header then, and not otherwise, so with the
+ * macro undefined there is no code, data or include cost at all).
+ *
+ * For each managed type T it counts:
+ *   constructs      - control blocks created (make, make_shared, allocate_shared, arrays, ...)
+ *   copies          - shared_p<T> copy constructions (including aliasing and converting copies, and share_n)
+ *   moves           - shared_p<T> move constructions
+ *   final releases  - objects destroyed, by the release of their last shared_p
+ *   live blocks     - control blocks not yet freed (a block outlives its object while weak_p's remain)
+ *   live bytes      - bytes held by those blocks (and by adopted objects), and the peak reached
+ *
+ * Event counts are kept per thread (a plain increment by the counting thread, no shared cache line), and summed
+ * when a snapshot is taken; live and peak bytes are global per type (they only change as blocks come and go).
+ * Blocks are counted under the type they were created for, copies and moves under the shared_p's own type.
+ * Counting never allocates, so the counters do not disturb the heap activity they are there to measure.
+ *
+ * Usage:	(build with -DSHARED_P_INSTRUMENTATION)
+ * 		std::vector<shared_p_stats> stats = shared_p_instrumentation::snapshot();
+ * 		shared_p_instrumentation::write(std::cout);   (one line per type, for scraping)
+ */
+struct shared_p_stats
+{
+	// The type's name (typeid(T).name())
+	const char* iType;
+
+	long long iConstructs;
+	long long iCopies;
+	long long iMoves;
+	long long iFinalReleases;
+	long long iLiveBlocks;
+	long long iLiveBytes;
+	long long iPeakLiveBytes;
+};
+
+class shared_p_instrumentation
+{
+public:
+	// The counters of every type counted so far (a snapshot, if other threads are counting)
+	static std::vector<shared_p_stats> snapshot();
+
+	// Writes snapshot() to aOut, one line per type:  <type> constructs=.. copies=.. moves=.. final_releases=.. live_blocks=.. live_bytes=.. peak_live_bytes=..
+	static void write(std::ostream& aOut);
+
+	// Events (called by shared_p and its control blocks)
+	template <typename T> static void construct(std::size_t aBytes);
+	template <typename T> static void destroy(std::size_t aBytes);
+	template <typename T> static void copy(std::size_t aCount);
+	template <typename T> static void move();
+	template <typename T> static void final_release();
+
+private:
+	enum event { kConstructs, kCopies, kMoves, kFinalReleases, kEvents };
+
+	struct thread_counters;
+
+	// Everything counted for one type
+	struct type_counters
+	{
+		explicit type_counters(const char* aName);
+
+		void add(shared_p_stats& aStats, const long long* aEvents) const;
+
+		const char* iName;
+
+		std::atomic<long long> iLiveBlocks;
+		std::atomic<long long> iLiveBytes;
+		std::atomic<long long> iPeakLiveBytes;
+
+		// The threads counting this type, and the counts of the threads which have exited
+		mutable std::mutex iMutex;
+		thread_counters* iThreads;
+		long long iRetired[kEvents];
+
+		// The next type counted (see types)
+		type_counters* iNext;
+	};
+
+	// One thread's counts for one type (only that thread writes them)
+	struct thread_counters
+	{
+		explicit thread_counters(type_counters& aType);
+		~thread_counters();
+
+		void count(event aEvent, std::size_t aCount)
+		{
+			iEvents[aEvent].store(iEvents[aEvent].load(std::memory_order_relaxed) + aCount, std::memory_order_relaxed);
+		}
+
+		type_counters& iType;
+		std::atomic<long long> iEvents[kEvents];
+
+		// The other threads counting iType
+		thread_counters* iPrevious;
+		thread_counters* iNext;
+	};
+
+	template <typename T> static type_counters& counters();
+	template <typename T> static thread_counters& local();
+
+	// Every type counted so far, most recent first (types are never removed, so the list is only ever pushed to)
+	static std::atomic<type_counters*>& types();
+};
+
+inline std::vector<shared_p_stats> shared_p_instrumentation::snapshot()
+{
+	std::vector<shared_p_stats> stats;
+	for (const type_counters* counted = types().load(std::memory_order_acquire); counted; counted = counted->iNext)
+	{
+		const type_counters& type = *counted;
+		shared_p_stats typeStats = { type.iName, 0, 0, 0, 0, 0, 0, 0 };
+
+		std::lock_guard<std::mutex> lock(type.iMutex);
+		type.add(typeStats, type.iRetired);
+		for (const thread_counters* thread = type.iThreads; thread; thread = thread->iNext)
+		{
+			long long events[kEvents];
+			for (int e = 0; e < kEvents; ++e)
+			{
+				events[e] = thread->iEvents[e].load(std::memory_order_relaxed);
+			}
+			type.add(typeStats, events);
+		}
+
+		typeStats.iLiveBlocks = type.iLiveBlocks.load(std::memory_order_relaxed);
+		typeStats.iLiveBytes = type.iLiveBytes.load(std::memory_order_relaxed);
+		typeStats.iPeakLiveBytes = type.iPeakLiveBytes.load(std::memory_order_relaxed);
+		stats.push_back(typeStats);
+	}
+	return stats;
+}
+
+inline void shared_p_instrumentation::write(std::ostream& aOut)
+{
+	std::vector<shared_p_stats> stats = snapshot();
+	for (std::size_t i = 0; i < stats.size(); ++i)
+	{
+		const shared_p_stats& s = stats[i];
+		aOut << s.iType
+			<< " constructs=" << s.iConstructs
+			<< " copies=" << s.iCopies
+			<< " moves=" << s.iMoves
+			<< " final_releases=" << s.iFinalReleases
+			<< " live_blocks=" << s.iLiveBlocks
+			<< " live_bytes=" << s.iLiveBytes
+			<< " peak_live_bytes=" << s.iPeakLiveBytes
+			<< '\n';
+	}
+}
+
+template <typename T>
+inline void shared_p_instrumentation::construct(std::size_t aBytes)
+{
+	local<T>().count(kConstructs, 1);
+
+	type_counters& type = counters<T>();
+	type.iLiveBlocks.fetch_add(1, std::memory_order_relaxed);
+	long long live = type.iLiveBytes.fetch_add(aBytes, std::memory_order_relaxed) + aBytes;
+	long long peak = type.iPeakLiveBytes.load(std::memory_order_relaxed);
+	while (live > peak && !type.iPeakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+	{
+	}
+}
+
+template <typename T>
+inline void shared_p_instrumentation::destroy(std::size_t aBytes)
+{
+	type_counters& type = counters<T>();
+	type.iLiveBlocks.fetch_sub(1, std::memory_order_relaxed);
+	type.iLiveBytes.fetch_sub(aBytes, std::memory_order_relaxed);
+}
+
+template <typename T>
+inline void shared_p_instrumentation::copy(std::size_t aCount)
+{
+	local<T>().count(kCopies, aCount);
+}
+
+template <typename T>
+inline void shared_p_instrumentation::move()
+{
+	local<T>().count(kMoves, 1);
+}
+
+template <typename T>
+inline void shared_p_instrumentation::final_release()
+{
+	local<T>().count(kFinalReleases, 1);
+}
+
+template <typename T>
+inline shared_p_instrumentation::type_counters& shared_p_instrumentation::counters()
+{
+	// never destroyed (blocks may be freed, and counted, during static destruction), and not on the heap
+	static typename std::aligned_storage<sizeof(type_counters), alignof(type_counters)>::type storage;
+	static type_counters* type = new (&storage) type_counters(typeid(T).name());
+	return *type;
+}
+
+template <typename T>
+inline shared_p_instrumentation::thread_counters& shared_p_instrumentation::local()
+{
+	static thread_local thread_counters counts(counters<T>());
+	return counts;
+}
+
+inline std::atomic<shared_p_instrumentation::type_counters*>& shared_p_instrumentation::types()
+{
+	// constant-initialised, and trivially destructible
+	static std::atomic<type_counters*> counted(nullptr);
+	return counted;
+}
+
+inline shared_p_instrumentation::type_counters::type_counters(const char* aName)
+	: iName(aName), iLiveBlocks(0), iLiveBytes(0), iPeakLiveBytes(0), iThreads(nullptr),
+	iNext(types().load(std::memory_order_relaxed))
+{
+	for (int e = 0; e < kEvents; ++e)
+	{
+		iRetired[e] = 0;
+	}
+
+	while (!types().compare_exchange_weak(iNext, this, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+inline void shared_p_instrumentation::type_counters::add(shared_p_stats& aStats, const long long* aEvents) const
+{
+	aStats.iConstructs += aEvents[kConstructs];
+	aStats.iCopies += aEvents[kCopies];
+	aStats.iMoves += aEvents[kMoves];
+	aStats.iFinalReleases += aEvents[kFinalReleases];
+}
+
+inline shared_p_instrumentation::thread_counters::thread_counters(type_counters& aType)
+	: iType(aType), iPrevious(nullptr)
+{
+	for (int e = 0; e < kEvents; ++e)
+	{
+		iEvents[e].store(0, std::memory_order_relaxed);
+	}
+
+	std::lock_guard<std::mutex> lock(iType.iMutex);
+	iNext = iType.iThreads;
+	if (iNext)
+	{
+		iNext->iPrevious = this;
+	}
+	iType.iThreads = this;
+}
+
+inline shared_p_instrumentation::thread_counters::~thread_counters()
+{
+	// keep this thread's counts in the totals after it has gone
+	std::lock_guard<std::mutex> lock(iType.iMutex);
+	for (int e = 0; e < kEvents; ++e)
+	{
+		iType.iRetired[e] += iEvents[e].load(std::memory_order_relaxed);
+	}
+	(iPrevious ? iPrevious->iNext : iType.iThreads) = iNext;
+	if (iNext)
+	{
+		iNext->iPrevious = iPrevious;
+	}
+}
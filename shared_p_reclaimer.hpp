@@ -0,0 +1,76 @@
+#pragma once
+#include "shared_p.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/*
+ * shared_p_reclaimer - a background thread which drains a shared_p_deferred_queue, so objects made with
+ * make_deferred are destroyed off the threads which released them.
+ *
+ * The queue is drained every aInterval, and once more when the reclaimer is destroyed (which stops and joins
+ * the thread). The queue must outlive the reclaimer.
+ *
+ * Example usage:
+ *
+ * 		shared_p_reclaimer reclaimer;   (drains shared_p_deferred_queue::global() every millisecond)
+ * 		shared_p<Index> index = shared_p<Index>::make_deferred(shared_p_deferred_queue::global(), path);
+ * 		...
+ * 		index = nullptr;                (returns immediately - the Index is destroyed on the reclaimer's thread)
+ */
+class shared_p_reclaimer
+{
+public:
+	explicit shared_p_reclaimer(shared_p_deferred_queue& aQueue = shared_p_deferred_queue::global(),
+		std::chrono::milliseconds aInterval = std::chrono::milliseconds(1));
+	~shared_p_reclaimer();
+
+	shared_p_reclaimer(const shared_p_reclaimer&) = delete;
+	shared_p_reclaimer& operator=(const shared_p_reclaimer&) = delete;
+
+private:
+	void run();
+
+	shared_p_deferred_queue& iQueue;
+	const std::chrono::milliseconds iInterval;
+
+	std::mutex iMutex;
+	std::condition_variable iWake;
+	bool iStopping;
+
+	// Started last, once everything it uses has been constructed
+	std::thread iThread;
+};
+
+inline shared_p_reclaimer::shared_p_reclaimer(shared_p_deferred_queue& aQueue, std::chrono::milliseconds aInterval)
+	: iQueue(aQueue), iInterval(aInterval), iStopping(false), iThread(&shared_p_reclaimer::run, this)
+{
+}
+
+inline shared_p_reclaimer::~shared_p_reclaimer()
+{
+	{
+		std::lock_guard<std::mutex> lock(iMutex);
+		iStopping = true;
+	}
+	iWake.notify_one();
+	iThread.join();
+
+	// anything released while the thread was stopping
+	iQueue.drain();
+}
+
+inline void shared_p_reclaimer::run()
+{
+	std::unique_lock<std::mutex> lock(iMutex);
+	while (!iStopping)
+	{
+		// drain without holding the lock, so stopping never waits on an object being destroyed
+		lock.unlock();
+		iQueue.drain();
+		lock.lock();
+
+		iWake.wait_for(lock, iInterval, [this] { return iStopping; });
+	}
+}
@@ -0,0 +1,247 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+/*
+ * shared_p_registry - a debug registry of every live control block, compiled in only when SHARED_P_DEBUG_REGISTRY
+ * is defined (shared_p.hpp includes this header then, and not otherwise).
+ *
+ * Each control block records the type it was made for and where it was made, and stays in the registry until it
+ * is freed. dump_live() lists the blocks live at the moment, with their counts; anything still live when the
+ * program exits is reported to std::cerr. An object that is never released, or is kept alive by a reference
+ * cycle, shows up as a block that stays live (a cycle as a group of blocks whose counts never reach zero).
+ *
+ * The allocation site is whatever SHARED_P_SITE was wrapped around (blocks made outside it are listed as made at
+ * "unknown"):
+ *
+ * 		shared_p<Node> node = SHARED_P_SITE(shared_p<Node>::make(parent));
+ * 		...
+ * 		shared_p_registry::dump_live(std::cout);
+ * 		  ->  N4Node use_count=2 made at server.cpp:120 (block 0x6021f0)
+ *
+ * The registry is sharded by block address, so threads making and freeing unrelated blocks seldom share a lock.
+ * The counts shown are snapshots, and are read without synchronisation for unsynchronized_policy blocks.
+ * Like shared_p_instrumentation, the registry never allocates: its records live in the control blocks.
+ */
+class shared_p_registry
+{
+public:
+	// A registered control block (shared_ctrl_block derives from this when the registry is compiled in)
+	struct entry
+	{
+		entry() : iType(nullptr), iFile(nullptr), iLine(0), iPrevious(nullptr), iNext(nullptr) { }
+		virtual ~entry() { }
+
+		// The block's strong count
+		virtual int live_count() const = 0;
+
+		const char* iType;
+		const char* iFile;
+		int iLine;
+
+		// The other blocks in the same shard
+		entry* iPrevious;
+		entry* iNext;
+	};
+
+	// Sets the allocation site recorded for the blocks made while it exists (see SHARED_P_SITE)
+	class site
+	{
+	public:
+		site(const char* aFile, int aLine);
+		~site();
+
+		site(const site&) = delete;
+		site& operator=(const site&) = delete;
+
+	private:
+		const char* iPreviousFile;
+		int iPreviousLine;
+	};
+
+	// Writes one line per live block to aOut, and returns how many there are
+	static std::size_t dump_live(std::ostream& aOut = std::cerr);
+
+	// The number of live blocks (a snapshot, if other threads are making blocks)
+	static std::size_t live();
+
+	// Should the blocks still live at exit be reported to std::cerr? (default true)
+	static void report_at_exit(bool aReport);
+
+	// Called by the control blocks
+	static void add(entry* aEntry, const char* aType);
+	static void remove(entry* aEntry);
+
+private:
+	static const std::size_t kShards = 16;
+
+	struct shard
+	{
+		std::mutex iMutex;
+		entry* iHead;
+		std::size_t iLive;
+	};
+
+	struct shard_table
+	{
+		shard iShards[kShards];
+	};
+
+	// Reports the blocks still live when static objects are destroyed
+	struct exit_report
+	{
+		exit_report() : iEnabled(true) { }
+		~exit_report();
+
+		bool iEnabled;
+	};
+
+	static shard* shards();
+	static shard& shard_of(const entry* aEntry);
+	static exit_report& report();
+
+	// The site set by the innermost site on this thread (nullptr for none)
+	static const char*& current_file();
+	static int& current_line();
+};
+
+inline shared_p_registry::site::site(const char* aFile, int aLine)
+	: iPreviousFile(current_file()), iPreviousLine(current_line())
+{
+	current_file() = aFile;
+	current_line() = aLine;
+}
+
+inline shared_p_registry::site::~site()
+{
+	current_file() = iPreviousFile;
+	current_line() = iPreviousLine;
+}
+
+inline std::size_t shared_p_registry::dump_live(std::ostream& aOut)
+{
+	std::size_t count = 0;
+	shard* all = shards();
+	for (std::size_t s = 0; s < kShards; ++s)
+	{
+		std::lock_guard<std::mutex> lock(all[s].iMutex);
+		for (const entry* block = all[s].iHead; block; block = block->iNext)
+		{
+			aOut << block->iType << " use_count=" << block->live_count() << " made at ";
+			if (block->iFile)
+			{
+				aOut << block->iFile << ':' << block->iLine;
+			}
+			else
+			{
+				aOut << "unknown";
+			}
+			aOut << " (block " << static_cast<const void*>(block) << ")\n";
+			++count;
+		}
+	}
+	return count;
+}
+
+inline std::size_t shared_p_registry::live()
+{
+	std::size_t count = 0;
+	shard* all = shards();
+	for (std::size_t s = 0; s < kShards; ++s)
+	{
+		std::lock_guard<std::mutex> lock(all[s].iMutex);
+		count += all[s].iLive;
+	}
+	return count;
+}
+
+inline void shared_p_registry::report_at_exit(bool aReport)
+{
+	shards();
+	report().iEnabled = aReport;
+}
+
+inline void shared_p_registry::add(entry* aEntry, const char* aType)
+{
+	aEntry->iType = aType;
+	aEntry->iFile = current_file();
+	aEntry->iLine = current_line();
+
+	shard& owner = shard_of(aEntry);
+	std::lock_guard<std::mutex> lock(owner.iMutex);
+	aEntry->iPrevious = nullptr;
+	aEntry->iNext = owner.iHead;
+	if (owner.iHead)
+	{
+		owner.iHead->iPrevious = aEntry;
+	}
+	owner.iHead = aEntry;
+	++owner.iLive;
+}
+
+inline void shared_p_registry::remove(entry* aEntry)
+{
+	// blocks whose construction failed part way were never added
+	if (!aEntry->iType)
+	{
+		return;
+	}
+
+	shard& owner = shard_of(aEntry);
+	std::lock_guard<std::mutex> lock(owner.iMutex);
+	(aEntry->iPrevious ? aEntry->iPrevious->iNext : owner.iHead) = aEntry->iNext;
+	if (aEntry->iNext)
+	{
+		aEntry->iNext->iPrevious = aEntry->iPrevious;
+	}
+	--owner.iLive;
+}
+
+inline shared_p_registry::exit_report::~exit_report()
+{
+	if (iEnabled && live())
+	{
+		std::cerr << "shared_p: " << live() << " control block(s) still live at exit:\n";
+		dump_live(std::cerr);
+	}
+}
+
+inline shared_p_registry::shard* shared_p_registry::shards()
+{
+	// never destroyed (blocks may be freed during static destruction), and not on the heap
+	static std::aligned_storage<sizeof(shard_table), alignof(shard_table)>::type storage;
+	static shard* all = (new (&storage) shard_table())->iShards;
+
+	// the report is made when the statics constructed after the first block are destroyed (statics constructed
+	// earlier are destroyed later, so blocks they still hold at that point are reported too)
+	report();
+	return all;
+}
+
+inline shared_p_registry::shard& shared_p_registry::shard_of(const entry* aEntry)
+{
+	// blocks are at least 16 byte aligned, so skip the low bits
+	return shards()[(reinterpret_cast<std::uintptr_t>(aEntry) >> 4) % kShards];
+}
+
+inline shared_p_registry::exit_report& shared_p_registry::report()
+{
+	static exit_report instance;
+	return instance;
+}
+
+inline const char*& shared_p_registry::current_file()
+{
+	static thread_local const char* file = nullptr;
+	return file;
+}
+
+inline int& shared_p_registry::current_line()
+{
+	static thread_local int line = 0;
+	return line;
+}
@@ -0,0 +1,417 @@
+#include "shared_p.hpp"
+#include "atomic_shared_p.hpp"
+#include "shared_p_epoch.hpp"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+	// If editing in Visual Studio, define these
+	// macros to allow compilation and manual inspection.
+	#define TEST(testclass, Title) void Title()
+	#define ASSERT_EQ(X,Y)
+	#define ASSERT_TRUE(X)
+#endif
+
+/*
+ * shared_p stress tests - many threads racing on the same handles, meant to be run under ThreadSanitizer as well
+ * as on their own (shared_p_test.cpp covers behaviour; these look for races, and for throughput that stops scaling).
+ *
+ * Each scenario runs at 1, 2, 4 and 8 threads (or pairs of threads), started together, and reports its
+ * throughput in total and per thread, e.g.
+ * 		[  STRESS  ] copy atomic_policy         threads=4       48.21 Mops/s      12.05 Mops/s per thread
+ * so a scaling regression shows up as a per thread figure which falls away as threads are added.
+ *
+ * Build and run with:  make stress   (./shared_p_stress, then ./shared_p_stress_tsan, built with -fsanitize=thread)
+ */
+
+enum { kMaxThreads = 8 };
+
+// (ThreadSanitizer runs the same code an order of magnitude slower)
+#ifdef SHARED_P_TSAN
+static const int kIterations = 20000;
+#else
+static const int kIterations = 200000;
+#endif
+
+// Runs aBody(thread) on aThreads threads, released together once all have started. Returns the seconds it took.
+template <typename Body>
+static double run_together(int aThreads, Body aBody)
+{
+	std::atomic<int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < aThreads; ++t)
+	{
+		threads.push_back(std::thread([&ready, &go, &aBody, t]()
+		{
+			++ready;
+			while (!go)
+			{
+				std::this_thread::yield();
+			}
+			aBody(t);
+		}));
+	}
+
+	while (ready != aThreads)
+	{
+		std::this_thread::yield();
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	go = true;
+	for (std::size_t t = 0; t < threads.size(); ++t)
+	{
+		threads[t].join();
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* aScenario, const char* aPolicy, int aThreads, double aOperations, double aSeconds)
+{
+	double total = aOperations / aSeconds / 1e6;
+	std::printf("[  STRESS  ] %-8s %-26s threads=%d %12.2f Mops/s %10.2f Mops/s per thread\n",
+		aScenario, aPolicy, aThreads, total, total / aThreads);
+}
+
+// Object which knows whether it is still alive, and counts its destruction
+struct Checked
+{
+	enum { kAlive = 0x600d };
+
+	explicit Checked(std::atomic<int>& aDestroyed) : iAlive(kAlive), iDestroyed(aDestroyed)
+	{
+		for (int t = 0; t < kMaxThreads; ++t)
+		{
+			iWritten[t] = 0;
+		}
+	}
+
+	~Checked()
+	{
+		// every thread's (plain) write must be visible to whichever thread destroys the object
+		for (int t = 0; t < kMaxThreads; ++t)
+		{
+			iDestroyed += iWritten[t] ? 100 : 0;
+		}
+		iAlive = 0;
+		++iDestroyed;
+	}
+
+	int iAlive;
+	int iWritten[kMaxThreads];
+	std::atomic<int>& iDestroyed;
+};
+
+// N threads copy and destroy copies of one shared object, all hitting its count
+template <typename Policy>
+static void contended_copy(const char* aPolicy)
+{
+	for (int threads = 1; threads <= kMaxThreads; threads *= 2)
+	{
+		std::atomic<int> destroyed(0);
+		std::atomic<int> dead(0);
+		shared_p<Checked, Policy> shared = shared_p<Checked, Policy>::make(destroyed);
+
+		double seconds = run_together(threads, [&shared, &dead](int)
+		{
+			for (int i = 0; i < kIterations; ++i)
+			{
+				shared_p<Checked, Policy> copy = shared;
+				shared_p<Checked, Policy> another = copy;
+				if (another->iAlive != Checked::kAlive)
+				{
+					++dead;
+				}
+			}
+		});
+		report("copy", aPolicy, threads, 2.0 * threads * kIterations, seconds);
+
+		ASSERT_EQ(dead, 0);
+		ASSERT_EQ(shared.count(), 1);
+		shared = nullptr;
+		ASSERT_EQ(destroyed, 1);
+	}
+}
+
+TEST(Contended, CopyAtomic) { contended_copy<atomic_policy>("atomic_policy"); }
+TEST(Contended, CopyBiased) { contended_copy<biased_policy>("biased_policy"); }
+TEST(Contended, CopyPadded) { contended_copy<padded_policy<> >("padded_policy<>"); }
+TEST(Contended, CopySharded) { contended_copy<sharded_policy<> >("sharded_policy<>"); }
+TEST(Contended, CopyPacked) { contended_copy<packed_policy>("packed_policy"); }
+TEST(Contended, CopyWide) { contended_copy<wide_policy>("wide_policy"); }
+
+// Every thread holds a copy, writes through it and drops it, racing the others for the last release
+template <typename Policy>
+static void last_reference(const char* aPolicy)
+{
+	const int kRounds = kIterations / 1000;
+	for (int threads = 1; threads <= kMaxThreads; threads *= 2)
+	{
+		for (int round = 0; round < kRounds; ++round)
+		{
+			std::atomic<int> destroyed(0);
+			std::vector<shared_p<Checked, Policy> > copies(threads);
+			{
+				shared_p<Checked, Policy> made = shared_p<Checked, Policy>::make(destroyed);
+				for (int t = 0; t < threads; ++t)
+				{
+					copies[t] = made;
+				}
+			}
+
+			run_together(threads, [&copies](int aThread)
+			{
+				shared_p<Checked, Policy> mine = std::move(copies[aThread]);
+				mine->iWritten[aThread] = 1;
+			});
+
+			// (biased counts released away from their owner wait for it to merge them)
+			biased_policy::merge();
+			ASSERT_EQ(destroyed, 100 * threads + 1);
+		}
+		std::printf("[  STRESS  ] last     %-26s threads=%d %d rounds\n", aPolicy, threads, kRounds);
+	}
+}
+
+TEST(LastReference, RaceAtomic) { last_reference<atomic_policy>("atomic_policy"); }
+TEST(LastReference, RaceBiased) { last_reference<biased_policy>("biased_policy"); }
+TEST(LastReference, RaceSharded) { last_reference<sharded_policy<4> >("sharded_policy<4>"); }
+TEST(LastReference, RacePacked) { last_reference<packed_policy>("packed_policy"); }
+
+// Threads lock weak_p's to an object while its last shared_p goes: each lock gets the live object, or nothing
+template <typename Policy>
+static void weak_lock_race(const char* aPolicy)
+{
+	const int kRounds = kIterations / 1000;
+	for (int threads = 2; threads <= kMaxThreads; threads *= 2)
+	{
+		for (int round = 0; round < kRounds; ++round)
+		{
+			std::atomic<int> destroyed(0);
+			std::atomic<int> dead(0);
+			shared_p<Checked, Policy> owner = shared_p<Checked, Policy>::make(destroyed);
+			weak_p<Checked, Policy> weak = owner;
+
+			run_together(threads, [&owner, &weak, &dead](int aThread)
+			{
+				if (aThread == 0)
+				{
+					owner = nullptr;
+					return;
+				}
+				for (;;)
+				{
+					shared_p<Checked, Policy> locked = weak.lock();
+					if (!locked)
+					{
+						break;
+					}
+					if (locked->iAlive != Checked::kAlive)
+					{
+						++dead;
+					}
+				}
+			});
+
+			ASSERT_EQ(dead, 0);
+			ASSERT_EQ(destroyed, 1);
+			ASSERT_TRUE(weak.expired());
+		}
+		std::printf("[  STRESS  ] weak     %-26s threads=%d %d rounds\n", aPolicy, threads, kRounds);
+	}
+}
+
+TEST(LastReference, WeakLockAtomic) { weak_lock_race<atomic_policy>("atomic_policy"); }
+TEST(LastReference, WeakLockSharded) { weak_lock_race<sharded_policy<4> >("sharded_policy<4>"); }
+TEST(LastReference, WeakLockPacked) { weak_lock_race<packed_policy>("packed_policy"); }
+TEST(LastReference, WeakLockWide) { weak_lock_race<wide_policy>("wide_policy"); }
+
+// A parcel passed back and forth between two threads, each incrementing it (plainly) before passing it on
+struct Parcel
+{
+	explicit Parcel(std::atomic<int>& aDestroyed) : iHops(0), iDestroyed(aDestroyed) { }
+	~Parcel() { ++iDestroyed; }
+
+	int iHops;
+	std::atomic<int>& iDestroyed;
+};
+
+// Pairs of threads play ping-pong with a shared_p through two atomic_shared_p mailboxes. A fresh parcel is sent
+// every 64 hops, so objects are made on one thread and destroyed on the other.
+TEST(PingPong, AtomicSharedP)
+{
+	const int kHops = kIterations / 10;
+	for (int pairs = 1; pairs <= kMaxThreads / 2; pairs *= 2)
+	{
+		std::atomic<int> destroyed(0);
+		std::atomic<int> wrong(0);
+		std::vector<atomic_shared_p<Parcel> > mailboxes(2 * pairs);
+
+		double seconds = run_together(2 * pairs, [&mailboxes, &destroyed, &wrong](int aThread)
+		{
+			atomic_shared_p<Parcel>& inbox = mailboxes[aThread];
+			atomic_shared_p<Parcel>& outbox = mailboxes[aThread ^ 1];
+			bool serving = (aThread & 1) == 0;
+			if (serving)
+			{
+				outbox.store(shared_p<Parcel>::make(destroyed));
+			}
+
+			for (int hop = serving ? 1 : 0; hop < kHops; hop += 2)
+			{
+				shared_p<Parcel> parcel;
+				while (!(parcel = inbox.exchange(shared_p<Parcel>())))
+				{
+					std::this_thread::yield();
+				}
+				if (parcel->iHops != hop % 64)
+				{
+					++wrong;
+				}
+				++parcel->iHops;
+				outbox.store(parcel->iHops == 64 ? shared_p<Parcel>::make(destroyed) : std::move(parcel));
+			}
+		});
+		report("pingpong", "atomic_shared_p", 2 * pairs, double(pairs) * kHops, seconds);
+
+		ASSERT_EQ(wrong, 0);
+		mailboxes.clear();
+		ASSERT_EQ(destroyed, pairs * (kHops / 64 + 1));
+	}
+}
+
+// Threads load() from one atomic_shared_p while a writer replaces its value, by store() and compare_exchange_strong()
+// in turn: every reservation a load makes races the swap, so the retired node is handed between them
+TEST(Publish, AtomicSharedPLoads)
+{
+	for (int threads = 2; threads <= kMaxThreads; threads *= 2)
+	{
+		std::atomic<int> destroyed(0);
+		std::atomic<int> made(1);
+		std::atomic<int> reading(threads - 1);
+		std::atomic<int> dead(0);
+		std::atomic<int> failed(0);
+		atomic_shared_p<Checked> published(shared_p<Checked>::make(destroyed));
+
+		double seconds = run_together(threads, [&published, &destroyed, &made, &reading, &dead, &failed](int aThread)
+		{
+			if (aThread == 0)
+			{
+				for (int i = 0; reading != 0; ++i)
+				{
+					shared_p<Checked> next = shared_p<Checked>::make(destroyed);
+					++made;
+					if (i % 2 == 0)
+					{
+						published.store(std::move(next));
+					}
+					else
+					{
+						// (the only writer, so the exchange can't fail)
+						shared_p<Checked> expected = published.load();
+						if (!published.compare_exchange_strong(expected, std::move(next)))
+						{
+							++failed;
+						}
+					}
+				}
+				return;
+			}
+
+			for (int i = 0; i < kIterations; ++i)
+			{
+				shared_p<Checked> loaded = published.load();
+				if (!loaded || loaded->iAlive != Checked::kAlive)
+				{
+					++dead;
+				}
+			}
+			--reading;
+		});
+		report("load", "atomic_shared_p", threads - 1, double(threads - 1) * kIterations, seconds);
+
+		ASSERT_EQ(dead, 0);
+		ASSERT_EQ(failed, 0);
+		ASSERT_EQ(destroyed, made - 1);
+		published.store(shared_p<Checked>());
+		ASSERT_EQ(destroyed, made);
+	}
+}
+
+// One writer keeps publishing new versions through an epoch_p, while the other threads read without counting
+TEST(Publish, EpochReaders)
+{
+	struct Version
+	{
+		explicit Version(int aNumber) : iNumber(aNumber), iAlive(Checked::kAlive) { }
+		~Version() { iAlive = 0; }
+		int iNumber;
+		int iAlive;
+	};
+
+	for (int threads = 2; threads <= kMaxThreads; threads *= 2)
+	{
+		epoch_p<Version> published(shared_p<Version>::make(0));
+		std::atomic<int> reading(threads - 1);
+		std::atomic<int> wrong(0);
+
+		double seconds = run_together(threads, [&published, &reading, &wrong](int aThread)
+		{
+			if (aThread == 0)
+			{
+				for (int i = 1; reading != 0; ++i)
+				{
+					published.store(shared_p<Version>::make(i));
+					std::this_thread::yield();
+				}
+				return;
+			}
+
+			int newest = 0;
+			for (int i = 0; i < kIterations; ++i)
+			{
+				shared_p_epoch::guard pinned;
+				const Version* version = published.get(pinned);
+				if (version->iAlive != Checked::kAlive || version->iNumber < newest)
+				{
+					++wrong;
+				}
+				newest = version->iNumber;
+			}
+			--reading;
+		});
+		report("epoch", "epoch_p readers", threads - 1, double(threads - 1) * kIterations, seconds);
+
+		ASSERT_EQ(wrong, 0);
+		shared_p_epoch::reclaim();
+		ASSERT_EQ(shared_p_epoch::pending(), 0u);
+	}
+}
+
+#ifdef _MSC_VER
+int main(int argc, char** argv)
+{
+	CopyAtomic();
+	CopyBiased();
+	CopyPadded();
+	CopySharded();
+	CopyPacked();
+	CopyWide();
+	RaceAtomic();
+	RaceBiased();
+	RaceSharded();
+	RacePacked();
+	WeakLockAtomic();
+	WeakLockSharded();
+	WeakLockPacked();
+	WeakLockWide();
+	AtomicSharedP();
+	AtomicSharedPLoads();
+	EpochReaders();
+	return 0;
+}
+#endif
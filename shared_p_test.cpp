@@ -1,180 +1,1981 @@
-//© 2016 Michael Cox
-#include "shared_p.hpp"
-#include "gtest/gtest.h"
-#include <string>
-
-#ifdef _MSC_VER
-	// If editing in Visual Studio, define these
-	// macros to allow compilation and manual inspection.
-	#define TEST(testclass, Title) void Title()
-	#define ASSERT_EQ(X,Y)
-	#define ASSERT_NE(X,Y)
-#endif
-
-// Simple object that owns an int*
-struct Data
-{
-	// takes ownership of aData
-	Data(int* aData) : iData(aData)	{ }
-	Data(Data&& other) = default;
-	Data(const Data& other) = default;
-
-	~Data()
-	{
-		// set to something other than *iData
-		*iData = 0xdeadbeef;
-		//std::cout << iData << " - *iData = " << std::hex << *iData << std::endl;
-		delete iData;
-		iData = nullptr;
-	}
-
-	int* iData;
-};
-
-// Tests compilation
-TEST(Basics, CanCreateShPofIntPtr)
-{
-	shared_p<int> s = shared_p<int>::make_shared(new int(5));
-}
-
-// Tests that d is set to null after shared_p is created
-// Tests that int* is deleted (value is set to something other than 5) (accessing deleted* is technically undefined behaviour)
-TEST(Basics, CanCreateShPOfData)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
-		ASSERT_EQ(*five, 5);
-		ASSERT_EQ(d, nullptr);
-	}
-	ASSERT_NE(*five, 5);
-}
-
-// Tests multiple shared_p
-TEST(Basics, CanCreate2ShP)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
-		ASSERT_EQ(d, nullptr);
-		ASSERT_EQ(*five, 5);
-
-		shared_p<Data> t = s;
-		ASSERT_EQ(*five, 5);
-	}
-	ASSERT_NE(*five, 5);
-}
-
-// Test multiple shared_p with different object lifetimes
-TEST(Basics, CanCreate2ShP_DiffSharedLifetimes)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
-		ASSERT_EQ(d, nullptr);
-
-		{
-			shared_p<Data> t = s;
-		} // t destroyed here
-		
-		// five should still be 5
-		ASSERT_EQ(*five, 5);
-	} // s deleted here
-	
-	ASSERT_NE(*five, 5);
-}
-
-// Test operator T& works
-TEST(Basics, TestOperatorT)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
-		ASSERT_EQ(d, nullptr);
-
-		ASSERT_EQ(*five, 5);
-
-		*((Data&)s).iData = 6;
-
-		ASSERT_EQ(*five, 6);
-	}
-	ASSERT_NE(*five, 5);
-}
-
-// Test T& get() works
-TEST(Basics, TestOperatorGet)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
-		ASSERT_EQ(d, nullptr);
-
-		ASSERT_EQ(*five, 5);
-
-		*(s.get().iData) = 6;
-
-		ASSERT_EQ(*five, 6);
-	}
-	ASSERT_NE(*five, 5);
-}
-
-void deleteFn(Data* aData)
-{
-	*aData->iData = 7;
-}
-
-//Test with custom deleter
-TEST(Basics, TestDeleter)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	Data* copy = d;
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d), deleteFn);
-		ASSERT_EQ(d, nullptr);
-
-		ASSERT_EQ(*five, 5);
-	}
-	ASSERT_EQ(*five, 7);
-	delete copy;
-}
-
-const int abcdef = 0xabcdefff;
-void DataFn(Data& aData)
-{
-	*aData.iData = abcdef;
-}
-
-//Test conversion to Data& automatically
-TEST(Basics, TestCanCallFunctionWithoutSharedPSigniture)
-{
-	int* five = new int(5);
-	Data* d = new Data(five);
-	Data* copy = d;
-	{
-		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
-		ASSERT_EQ(*five, 5);
-		DataFn(s);
-		ASSERT_EQ(*five, abcdef);
-	}
-}
-
-#ifdef _MSC_VER
-int main(int argc, char** argv)
-{
-	CanCreateShPofIntPtr();
-	CanCreateShPOfData();
-	CanCreate2ShP();
-	CanCreate2ShP_DiffSharedLifetimes();
-	TestOperatorT();
-	TestOperatorGet();
-	TestDeleter();
-	TestCanCallFunctionWithoutSharedPSigniture();
-	return 0;
-}
-#endif
+//© 2016 Michael Cox
+#include "shared_p.hpp"
+#include "atomic_shared_p.hpp"
+#include "intrusive_p.hpp"
+#include "shared_p_reclaimer.hpp"
+#include "shared_p_epoch.hpp"
+#include "gtest/gtest.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+#ifdef _MSC_VER
+	// If editing in Visual Studio, define these
+	// macros to allow compilation and manual inspection.
+	#define TEST(testclass, Title) void Title()
+	#define ASSERT_EQ(X,Y)
+	#define ASSERT_NE(X,Y)
+	#define ASSERT_GT(X,Y)
+	#define ASSERT_TRUE(X)
+	#define ASSERT_FALSE(X)
+	#define ASSERT_GE(X,Y)
+	#define ASSERT_THROW(X,E)
+#endif
+
+// Simple object that owns an int*
+struct Data
+{
+	// takes ownership of aData
+	Data(int* aData) : iData(aData)	{ }
+	Data(Data&& other) = default;
+	Data(const Data& other) = default;
+
+	~Data()
+	{
+		// set to something other than *iData
+		*iData = 0xdeadbeef;
+		//std::cout << iData << " - *iData = " << std::hex << *iData << std::endl;
+		delete iData;
+		iData = nullptr;
+	}
+
+	int* iData;
+};
+
+// Object which counts its destructions, so a test can check when (and that) the last owner let it go
+// without reading memory it has freed
+static int gTrackedDestroyed = 0;
+
+struct Tracked
+{
+	explicit Tracked(int aValue) : iValue(aValue) { }
+	~Tracked() { ++gTrackedDestroyed; }
+
+	int iValue;
+};
+
+// Global allocator hooks - count every allocation/deallocation made through operator new/delete,
+// so tests can check exactly how much heap traffic shared_p generates.
+static std::atomic<long> gAllocations(0);
+static std::atomic<long> gDeallocations(0);
+static std::atomic<std::size_t> gLastAllocationSize(0);
+
+void* operator new(std::size_t aSize)
+{
+	++gAllocations;
+	gLastAllocationSize = aSize;
+	void* memory = std::malloc(aSize ? aSize : 1);
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void operator delete(void* aMemory) noexcept
+{
+	if (aMemory)
+	{
+		++gDeallocations;
+		std::free(aMemory);
+	}
+}
+
+void operator delete(void* aMemory, std::size_t) noexcept
+{
+	operator delete(aMemory);
+}
+
+// Tests compilation
+TEST(Basics, CanCreateShPofIntPtr)
+{
+	shared_p<int> s = shared_p<int>::make_shared(new int(5));
+}
+
+// Tests that d is set to null after shared_p is created
+// Tests that int* is deleted (value is set to something other than 5) (accessing deleted* is technically undefined behaviour)
+TEST(Basics, CanCreateShPOfData)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(*five, 5);
+		ASSERT_EQ(d, nullptr);
+	}
+	ASSERT_NE(*five, 5);
+}
+
+// Tests multiple shared_p
+TEST(Basics, CanCreate2ShP)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(d, nullptr);
+		ASSERT_EQ(*five, 5);
+
+		shared_p<Data> t = s;
+		ASSERT_EQ(*five, 5);
+	}
+	ASSERT_NE(*five, 5);
+}
+
+// Test multiple shared_p with different object lifetimes
+TEST(Basics, CanCreate2ShP_DiffSharedLifetimes)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(d, nullptr);
+
+		{
+			shared_p<Data> t = s;
+		} // t destroyed here
+		
+		// five should still be 5
+		ASSERT_EQ(*five, 5);
+	} // s deleted here
+	
+	ASSERT_NE(*five, 5);
+}
+
+// Test operator T& works
+TEST(Basics, TestOperatorT)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(d, nullptr);
+
+		ASSERT_EQ(*five, 5);
+
+		*((Data&)s).iData = 6;
+
+		ASSERT_EQ(*five, 6);
+	}
+	ASSERT_NE(*five, 5);
+}
+
+// Test T& get() works
+TEST(Basics, TestOperatorGet)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(d, nullptr);
+
+		ASSERT_EQ(*five, 5);
+
+		*(s.get().iData) = 6;
+
+		ASSERT_EQ(*five, 6);
+	}
+	ASSERT_NE(*five, 5);
+}
+
+void deleteFn(Data* aData)
+{
+	*aData->iData = 7;
+}
+
+//Test with custom deleter
+TEST(Basics, TestDeleter)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	Data* copy = d;
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d), deleteFn);
+		ASSERT_EQ(d, nullptr);
+
+		ASSERT_EQ(*five, 5);
+	}
+	ASSERT_EQ(*five, 7);
+	delete copy;
+}
+
+const int abcdef = 0xabcdefff;
+void DataFn(Data& aData)
+{
+	*aData.iData = abcdef;
+}
+
+//Test conversion to Data& automatically
+TEST(Basics, TestCanCallFunctionWithoutSharedPSigniture)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	Data* copy = d;
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(*five, 5);
+		DataFn(s);
+		ASSERT_EQ(*five, abcdef);
+	}
+}
+
+// Test in-place construction (object lives inside the control block)
+TEST(Make, CanMakeInPlace)
+{
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Tracked> s = shared_p<Tracked>::make(5);
+		ASSERT_EQ(s.get().iValue, 5);
+
+		shared_p<Tracked> t = s;
+		ASSERT_EQ(s.count(), 2);
+		ASSERT_EQ(&t.get(), &s.get());
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test make forwards its arguments to T's constructor
+TEST(Make, MakeForwardsArguments)
+{
+	shared_p<std::string> s = shared_p<std::string>::make(3, 'x');
+	ASSERT_EQ(s.get(), "xxx");
+
+	shared_p<int> i = make_shared_p<int>(5);
+	ASSERT_EQ(i.get(), 5);
+	ASSERT_EQ(i.count(), 1);
+}
+
+// Test make_shared allocates only the control block, and frees everything it allocates
+TEST(Allocations, MakeSharedAllocatesOnlyControlBlock)
+{
+	Data* d = new Data(new int(5));
+
+	long allocations = gAllocations;
+	long deallocations = gDeallocations;
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d));
+		ASSERT_EQ(gAllocations - allocations, 1);
+
+		shared_p<Data> t = s;
+		ASSERT_EQ(gAllocations - allocations, 1);
+	}
+	// control block, Data and Data's int
+	ASSERT_EQ(gDeallocations - deallocations, 3);
+}
+
+// Test make performs a single allocation for the object and its control block
+TEST(Allocations, MakeAllocatesOnce)
+{
+	int* five = new int(5);
+
+	long allocations = gAllocations;
+	long deallocations = gDeallocations;
+	{
+		shared_p<Data> s = shared_p<Data>::make(five);
+		ASSERT_EQ(gAllocations - allocations, 1);
+	}
+	// control block (holding Data) and Data's int
+	ASSERT_EQ(gDeallocations - deallocations, 2);
+}
+
+// The handle is an object pointer and a control block pointer, with no vtable
+static_assert(sizeof(shared_p<Data>) == 2 * sizeof(void*), "shared_p should be two pointers");
+static_assert(!std::is_polymorphic<shared_p<Data> >::value, "shared_p should not have a vtable");
+static_assert(is_trivially_relocatable<shared_p<Data> >::value, "shared_p should be trivially relocatable");
+
+// Test handles moved in bulk (memcpy) keep their counts, and release correctly afterwards
+TEST(Relocation, RelocateKeepsOwnership)
+{
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Tracked> s = shared_p<Tracked>::make(5);
+
+		typedef std::aligned_storage<sizeof(shared_p<Tracked>), alignof(shared_p<Tracked>)>::type Slot;
+		Slot source[4];
+		Slot dest[4];
+		shared_p<Tracked>* from = reinterpret_cast<shared_p<Tracked>*>(source);
+		shared_p<Tracked>* to = reinterpret_cast<shared_p<Tracked>*>(dest);
+
+		for (int i = 0; i < 4; ++i)
+		{
+			new (from + i) shared_p<Tracked>(s);
+		}
+		ASSERT_EQ(s.count(), 5);
+
+		relocate_n(from, 4, to);
+		ASSERT_EQ(s.count(), 5);
+		ASSERT_EQ(&to[3].get(), &s.get());
+
+		for (int i = 0; i < 4; ++i)
+		{
+			to[i].~shared_p<Tracked>();
+		}
+		ASSERT_EQ(s.count(), 1);
+		ASSERT_EQ(gTrackedDestroyed, 0);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Object written (non-atomically) by several threads through their own shared_p copies.
+// The destructor checks every write is visible, which relies on the release/acquire pairing in ~shared_p.
+struct Slots
+{
+	enum { kThreads = 8 };
+
+	Slots() : iDestroyed(nullptr)
+	{
+		for (int i = 0; i < kThreads; ++i)
+		{
+			iWritten[i] = 0;
+		}
+	}
+
+	~Slots()
+	{
+		int written = 0;
+		for (int i = 0; i < kThreads; ++i)
+		{
+			written += iWritten[i];
+		}
+		iDestroyed->fetch_add(written);
+	}
+
+	int iWritten[kThreads];
+	std::atomic_int* iDestroyed;
+};
+
+// The copies each thread makes in RaceCopyAndDestroy: two, from the copy it was given
+template <typename Policy>
+static void CopyFromMine(const shared_p<Slots, Policy>& aMine, const weak_p<Slots, Policy>&)
+{
+	shared_p<Slots, Policy> local = aMine;
+	shared_p<Slots, Policy> another = local;
+}
+
+// Nothing for RaceCopyAndDestroy's owner to do, and no copies for it to keep
+template <typename Policy>
+static std::vector<shared_p<Slots, Policy> > KeepNothing(const shared_p<Slots, Policy>&)
+{
+	return std::vector<shared_p<Slots, Policy> >();
+}
+
+/* Many threads copy and destroy copies of a shared object, racing for the last reference. Each thread calls
+   aCopy(mine, weak) 10000 times; aOwner(object) runs on this thread meanwhile, and the copies it returns are
+   kept (holding the object alive) until the threads have finished. */
+template <typename Policy, typename Copy, typename Owner>
+static void RaceCopyAndDestroy(Copy aCopy, Owner aOwner)
+{
+	typedef shared_p<Slots, Policy> handle;
+
+	for (int round = 0; round < 20; ++round)
+	{
+		std::atomic_int destroyed(0);
+		std::vector<std::thread> threads;
+		std::vector<handle> kept;
+		{
+			handle s = handle::make();
+			s.get().iDestroyed = &destroyed;
+			weak_p<Slots, Policy> weak = s;
+
+			for (int t = 0; t < Slots::kThreads; ++t)
+			{
+				handle copy = s;
+				threads.push_back(std::thread([t, weak, aCopy](handle mine)
+				{
+					for (int i = 0; i < 10000; ++i)
+					{
+						aCopy(mine, weak);
+					}
+					mine.get().iWritten[t] = 1;
+				}, std::move(copy)));
+			}
+			kept = aOwner(s);
+		} // s released here, while the threads may still be running
+		for (size_t t = 0; t < threads.size(); ++t)
+		{
+			threads[t].join();
+		}
+		if (!kept.empty())
+		{
+			ASSERT_EQ(destroyed, 0);
+			kept.clear();
+		}
+
+		// (copies of a biased object destroyed away from its owner wait for the owner to merge them)
+		biased_policy::merge();
+		ASSERT_EQ(destroyed, Slots::kThreads);
+	}
+}
+
+template <typename Policy>
+static void RaceCopyAndDestroy()
+{
+	RaceCopyAndDestroy<Policy>(CopyFromMine<Policy>, KeepNothing<Policy>);
+}
+
+// Test many threads copying and destroying copies of a shared object, racing for the last reference
+TEST(Threads, ConcurrentCopyAndDestroy)
+{
+	RaceCopyAndDestroy<atomic_policy>();
+}
+
+// Handles with different count policies are unrelated types
+static_assert(!std::is_constructible<shared_p<int, unsynchronized_policy>, shared_p<int> >::value,
+	"shared_p should not convert between count policies");
+static_assert(!std::is_constructible<shared_p<int>, shared_p<int, unsynchronized_policy> >::value,
+	"shared_p should not convert between count policies");
+
+// Test the non-atomic policy has the same ownership semantics as the default one
+TEST(Policy, UnsynchronizedPolicy)
+{
+	gTrackedDestroyed = 0;
+	Tracked* tracked = new Tracked(5);
+	{
+		shared_p<Tracked, unsynchronized_policy> s = shared_p<Tracked, unsynchronized_policy>::make_shared(std::move(tracked));
+		ASSERT_EQ(tracked, nullptr);
+		{
+			shared_p<Tracked, unsynchronized_policy> t = s;
+			ASSERT_EQ(s.count(), 2);
+		}
+		ASSERT_EQ(s.count(), 1);
+		ASSERT_EQ(gTrackedDestroyed, 0);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+
+	shared_p<std::string, unsynchronized_policy> m = make_shared_p<std::string, unsynchronized_policy>(2, 'y');
+	ASSERT_EQ(m.get(), "yy");
+}
+
+// Test the biased policy counts the owner's copies locally, and keeps the object alive for other threads
+TEST(Policy, BiasedPolicy)
+{
+	gTrackedDestroyed = 0;
+	shared_p<Tracked, biased_policy> s = shared_p<Tracked, biased_policy>::make(5);
+	{
+		shared_p<Tracked, biased_policy> t = s;
+		ASSERT_EQ(s.count(), 2);
+	}
+	ASSERT_EQ(s.count(), 1);
+
+	// the owner drops its last copy while another thread still holds one
+	shared_p<Tracked, biased_policy> elsewhere;
+	std::thread([&elsewhere, &s]() { elsewhere = s; }).join();
+	ASSERT_EQ(s.count(), 2);
+	weak_p<Tracked, biased_policy> weak = s;
+	s = nullptr;
+	ASSERT_EQ(elsewhere.count(), 1);
+	ASSERT_EQ(gTrackedDestroyed, 0);
+
+	// once drained, the owner counts in the shared count like any other thread
+	shared_p<Tracked, biased_policy> back = weak.lock();
+	ASSERT_EQ(back.count(), 2);
+	back = nullptr;
+	std::thread([&elsewhere]() { elsewhere = nullptr; }).join();
+	ASSERT_TRUE(weak.expired());
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test many threads copying a biased object while its owner copies it too
+TEST(Policy, BiasedConcurrentCopyAndDestroy)
+{
+	typedef shared_p<Slots, biased_policy> biased;
+
+	// the copies the owner makes are destroyed on the other threads, so the owner has to merge them
+	RaceCopyAndDestroy<biased_policy>(CopyFromMine<biased_policy>, [](const biased& aOwned) -> std::vector<biased>
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			biased local = aOwned;
+		}
+		return std::vector<biased>();
+	});
+}
+
+// Test an object whose owner has exited is destroyed by the thread which releases its last copy
+TEST(Policy, BiasedOwnerExits)
+{
+	gTrackedDestroyed = 0;
+	shared_p<Tracked, biased_policy> adopted;
+	std::thread([&adopted]()
+	{
+		shared_p<Tracked, biased_policy> s = shared_p<Tracked, biased_policy>::make(5);
+		adopted = s;
+	}).join();
+	ASSERT_EQ(adopted.count(), 1);
+	ASSERT_EQ(gTrackedDestroyed, 0);
+
+	adopted = nullptr;
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test padded counts keep a cache line clear either side, and count as their base policy does
+TEST(Policy, PaddedPolicy)
+{
+	static_assert(sizeof(padded_policy<>::ref_count) >= 2 * shared_p_cache_line + sizeof(atomic_policy::ref_count),
+		"padded count should have a cache line either side");
+
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Tracked, padded_policy<> > s = shared_p<Tracked, padded_policy<> >::make(5);
+		shared_p<Tracked, padded_policy<> > t = s;
+		weak_p<Tracked, padded_policy<> > w = t;
+		ASSERT_EQ(s.count(), 2);
+		ASSERT_EQ(w.lock()->iValue, 5);
+
+		shared_p<int, padded_policy<unsynchronized_policy> > local = make_shared_p<int, padded_policy<unsynchronized_policy> >(3);
+		ASSERT_EQ(local.count(), 1);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test wide counts are 64 bits, and count as atomic_policy does
+TEST(Policy, WidePolicy)
+{
+	static_assert(sizeof(wide_policy::ref_count) == 2 * sizeof(long long), "wide counts should be 64 bits each");
+	static_assert(std::is_same<decltype(shared_p<int, wide_policy>().count()), long long>::value, "count() should be as wide as the count");
+	static_assert(std::is_same<decltype(shared_p<int>().count()), int>::value, "the default count is an int");
+
+	gTrackedDestroyed = 0;
+	weak_p<Tracked, wide_policy> w;
+	{
+		shared_p<Tracked, wide_policy> s = shared_p<Tracked, wide_policy>::make(5);
+		w = s;
+		std::vector<shared_p<Tracked, wide_policy> > copies;
+		s.share_n(3, std::back_inserter(copies));
+		ASSERT_EQ(w.count(), 4);
+		ASSERT_EQ(w.lock()->iValue, 5);
+		shared_p<Tracked, wide_policy>::release_n(copies.begin(), copies.size());
+		ASSERT_EQ(s.count(), 1);
+		ASSERT_EQ(gTrackedDestroyed, 0);
+	}
+	ASSERT_TRUE(w.expired());
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test packed counts share one word, and the block is freed whichever of shared_p and weak_p goes last
+TEST(Policy, PackedPolicy)
+{
+	static_assert(sizeof(packed_policy::ref_count) == sizeof(std::uint64_t), "packed counts should share one 64-bit word");
+
+	// the only copy, with no weak_p: released without a read-modify-write (one block, holding the object)
+	gTrackedDestroyed = 0;
+	long deallocations = gDeallocations;
+	{
+		shared_p<Tracked, packed_policy> s = shared_p<Tracked, packed_policy>::make(5);
+		ASSERT_EQ(s.count(), 1);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+	ASSERT_EQ(gDeallocations - deallocations, 1);
+
+	// a weak_p keeps the block, and sees the object go
+	weak_p<Tracked, packed_policy> w;
+	deallocations = gDeallocations;
+	{
+		shared_p<Tracked, packed_policy> s = shared_p<Tracked, packed_policy>::make(6);
+		shared_p<Tracked, packed_policy> t = s;
+		w = t;
+		ASSERT_EQ(s.count(), 2);
+		ASSERT_EQ(w.count(), 2);
+		ASSERT_EQ(w.lock()->iValue, 6);
+	}
+	ASSERT_TRUE(w.expired());
+	ASSERT_EQ(gTrackedDestroyed, 2);
+	ASSERT_EQ(gDeallocations - deallocations, 0);
+	w = weak_p<Tracked, packed_policy>();
+	ASSERT_EQ(gDeallocations - deallocations, 1);
+
+	// and one which outlives its weak_p's
+	shared_p<int, packed_policy> kept = make_shared_p<int, packed_policy>(7);
+	{
+		weak_p<int, packed_policy> passing = kept;
+		ASSERT_EQ(passing.lock().count(), 2);
+	}
+	ASSERT_EQ(kept.count(), 1);
+	deallocations = gDeallocations;
+	kept = nullptr;
+	ASSERT_EQ(gDeallocations - deallocations, 1);
+}
+
+// Test many threads copying and destroying packed counts (and locking weak_p's), racing for the last release
+TEST(Policy, PackedConcurrentCopyAndDestroy)
+{
+	typedef shared_p<Slots, packed_policy> packed;
+
+	RaceCopyAndDestroy<packed_policy>([](const packed&, const weak_p<Slots, packed_policy>& aWeak)
+	{
+		packed local = aWeak.lock();
+		packed another = local;
+	}, KeepNothing<packed_policy>);
+}
+
+// Test sharded counts keep each slot on its own cache line, and count as atomic_policy does wherever copies go
+TEST(Policy, ShardedPolicy)
+{
+	static_assert(sizeof(sharded_policy<4>::ref_count) >= 6 * shared_p_cache_line, "each slot should have a cache line of its own");
+
+	gTrackedDestroyed = 0;
+	weak_p<Tracked, sharded_policy<> > w;
+	{
+		shared_p<Tracked, sharded_policy<> > s = shared_p<Tracked, sharded_policy<> >::make(5);
+		w = s;
+		shared_p<Tracked, sharded_policy<> > t = s;
+		ASSERT_EQ(s.count(), 2);
+
+		// copies made here, released on another thread (and the other way round)
+		std::vector<shared_p<Tracked, sharded_policy<> > > copies;
+		s.share_n(3, std::back_inserter(copies));
+		ASSERT_EQ(s.count(), 5);
+		shared_p<Tracked, sharded_policy<> > back;
+		std::thread([&copies, &back, &t]()
+		{
+			copies.clear();
+			back = t;
+		}).join();
+		ASSERT_EQ(s.count(), 3);
+		back = nullptr;
+		ASSERT_EQ(s.count(), 2);
+
+		ASSERT_EQ(w.lock()->iValue, 5);
+		shared_p<Tracked, sharded_policy<> >::release_n(&t, 1);
+		ASSERT_EQ(s.count(), 1);
+		ASSERT_EQ(gTrackedDestroyed, 0);
+	}
+	ASSERT_TRUE(w.expired());
+	ASSERT_EQ(w.lock().count(), 0);
+	ASSERT_EQ(gTrackedDestroyed, 1);
+
+	// a copy made elsewhere may be the last
+	shared_p<Tracked, sharded_policy<> > made = shared_p<Tracked, sharded_policy<> >::make(6);
+	shared_p<Tracked, sharded_policy<> > elsewhere;
+	std::thread([&made, &elsewhere]() { elsewhere = made; }).join();
+	made = nullptr;
+	ASSERT_EQ(gTrackedDestroyed, 1);
+	ASSERT_EQ(elsewhere.count(), 1);
+	elsewhere = nullptr;
+	ASSERT_EQ(gTrackedDestroyed, 2);
+}
+
+// Test many threads copying a sharded object (more threads than slots), handing copies between them and racing for the last release
+TEST(Policy, ShardedConcurrentCopyAndDestroy)
+{
+	typedef shared_p<Slots, sharded_policy<4> > sharded;
+
+	// the copies the owner hands out keep it alive until they go
+	RaceCopyAndDestroy<sharded_policy<4> >([](const sharded& aMine, const weak_p<Slots, sharded_policy<4> >& aWeak)
+	{
+		sharded local = aMine;
+		sharded another = aWeak.lock();
+	}, [](const sharded& aOwned)
+	{
+		return std::vector<sharded>(Slots::kThreads, aOwned);
+	});
+}
+
+// Standard allocator which counts the allocations/deallocations it serves
+template <typename U>
+struct CountingAllocator
+{
+	typedef U value_type;
+
+	CountingAllocator(int* aAllocated, int* aFreed) : iAllocated(aAllocated), iFreed(aFreed) { }
+	template <typename V>
+	CountingAllocator(const CountingAllocator<V>& aOther) : iAllocated(aOther.iAllocated), iFreed(aOther.iFreed) { }
+
+	U* allocate(std::size_t aCount)
+	{
+		++*iAllocated;
+		return static_cast<U*>(::operator new(aCount * sizeof(U)));
+	}
+
+	void deallocate(U* aMemory, std::size_t)
+	{
+		++*iFreed;
+		::operator delete(aMemory);
+	}
+
+	int* iAllocated;
+	int* iFreed;
+};
+
+template <typename U, typename V>
+bool operator==(const CountingAllocator<U>& aLeft, const CountingAllocator<V>& aRight) { return aLeft.iAllocated == aRight.iAllocated; }
+template <typename U, typename V>
+bool operator!=(const CountingAllocator<U>& aLeft, const CountingAllocator<V>& aRight) { return !(aLeft == aRight); }
+
+// Test allocate_shared gets (and returns) the control block from the supplied allocator
+TEST(Allocators, AllocateSharedUsesAllocator)
+{
+	int allocated = 0;
+	int freed = 0;
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Tracked> s = shared_p<Tracked>::allocate_shared(CountingAllocator<Tracked>(&allocated, &freed), 5);
+		ASSERT_EQ(allocated, 1);
+		ASSERT_EQ(s.get().iValue, 5);
+
+		shared_p<Tracked> t = s;
+		ASSERT_EQ(allocated, 1);
+		ASSERT_EQ(freed, 0);
+	}
+	ASSERT_EQ(freed, 1);
+	ASSERT_EQ(gTrackedDestroyed, 1);
+
+	shared_p<std::string> str = allocate_shared_p<std::string>(CountingAllocator<std::string>(&allocated, &freed), 2, 'z');
+	ASSERT_EQ(str.get(), "zz");
+	ASSERT_EQ(allocated, 2);
+}
+
+// Test pooled control blocks are recycled, so steady state construction/destruction doesn't touch the global heap
+TEST(Allocators, MakePooledRecyclesBlocks)
+{
+	{
+		// warm up this thread's pool
+		shared_p<int> warm = shared_p<int>::make_pooled(1);
+	}
+
+	long allocations = gAllocations;
+	long deallocations = gDeallocations;
+	for (int i = 0; i < 100; ++i)
+	{
+		shared_p<int> s = shared_p<int>::make_pooled(i);
+		shared_p<int> t = s;
+		ASSERT_EQ(t.get(), i);
+	}
+	ASSERT_EQ(gAllocations - allocations, 0);
+	ASSERT_EQ(gDeallocations - deallocations, 0);
+}
+
+// Test a pooled block freed after its thread's pool has been destroyed goes back to the global heap
+TEST(Allocators, MakePooledOutlivesThePool)
+{
+	long deallocations = gDeallocations;
+	std::thread([]() { }).join();
+	long threadDeallocations = gDeallocations - deallocations;
+
+	deallocations = gDeallocations;
+	std::thread([]()
+	{
+		// constructed before the pool's list, so destroyed after it
+		static thread_local std::unique_ptr<shared_p<int> > held;
+		held.reset(new shared_p<int>(shared_p<int>::make_pooled(1)));
+	}).join();
+
+	// the pooled block, and the shared_p holding it
+	ASSERT_EQ(gDeallocations - deallocations, threadDeallocations + 2);
+}
+
+// Test a lambda can be used as the deleter
+TEST(Deleters, LambdaDeleter)
+{
+	int* five = new int(5);
+	Data* d = new Data(five);
+	Data* copy = d;
+	{
+		shared_p<Data> s = shared_p<Data>::make_shared(std::move(d), [](Data* aData) { *aData->iData = 8; });
+		ASSERT_EQ(d, nullptr);
+		ASSERT_EQ(*five, 5);
+	}
+	ASSERT_EQ(*five, 8);
+	delete copy;
+}
+
+// Test a stateless deleter takes no space in the control block, while a function pointer does
+TEST(Deleters, StatelessDeleterTakesNoSpace)
+{
+	shared_p<int> byDefault = shared_p<int>::make_shared(new int(1));
+	std::size_t defaultSize = gLastAllocationSize;
+
+	shared_p<int> byLambda = shared_p<int>::make_shared(new int(2), [](int* aInt) { delete aInt; });
+	std::size_t lambdaSize = gLastAllocationSize;
+
+	void (*deleteInt)(int*) = [](int* aInt) { delete aInt; };
+	shared_p<int> byPointer = shared_p<int>::make_shared(new int(3), deleteInt);
+	std::size_t pointerSize = gLastAllocationSize;
+
+	ASSERT_EQ(lambdaSize, defaultSize);
+	ASSERT_GT(pointerSize, defaultSize);
+
+#if SHARED_P_CPLUSPLUS >= 201402L
+	// a final deleter can't be an empty base, so it is held as a member instead
+	struct FinalDeleter final
+	{
+		void operator()(int* aInt) const { delete aInt; }
+	};
+	shared_p<int> byFinal = shared_p<int>::make_shared(new int(4), FinalDeleter());
+	ASSERT_EQ(byFinal.get(), 4);
+#endif
+}
+
+// Objects handed out by a fixed pool, and given back (not deleted) when their last shared_p goes
+struct IntPool
+{
+	IntPool() : iFree(0) { }
+
+	int* take() { return &iInts[iFree++]; }
+	void give_back(int* aInt) { *aInt = -1; --iFree; }
+
+	int iInts[4];
+	int iFree;
+};
+
+// Test a capturing (stateful) deleter is held inline in the control block: one allocation, sized for the capture
+TEST(Deleters, StatefulDeleterIsInline)
+{
+	IntPool pool;
+	long allocations = gAllocations;
+	{
+		shared_p<int> s = shared_p<int>::make_shared(pool.take(), [&pool](int* aInt) { pool.give_back(aInt); });
+		ASSERT_EQ(gAllocations - allocations, 1);
+		ASSERT_GE(gLastAllocationSize, sizeof(shared_ctrl_block<atomic_policy>) + 2 * sizeof(void*));
+		ASSERT_EQ(pool.iFree, 1);
+
+		shared_p<int> t = s;
+		ASSERT_EQ(gAllocations - allocations, 1);
+	}
+	ASSERT_EQ(pool.iFree, 0);
+	ASSERT_EQ(pool.iInts[0], -1);
+}
+
+// Test a deleter and an allocator together: the block comes from the allocator, and nothing else is allocated
+TEST(Deleters, DeleterWithAllocator)
+{
+	IntPool pool;
+	int allocated = 0;
+	int freed = 0;
+	long allocations = gAllocations;
+	weak_p<int> weak;
+	{
+		int* first = pool.take();
+		shared_p<int> s = shared_p<int>::make_shared(std::move(first), [&pool](int* aInt) { pool.give_back(aInt); },
+			CountingAllocator<int>(&allocated, &freed));
+		ASSERT_EQ(first, nullptr);
+		ASSERT_EQ(allocated, 1);
+		ASSERT_EQ(gAllocations - allocations, allocated);
+		weak = s;
+	}
+
+	// the object goes with its last shared_p, the block (and its allocation) with the last weak_p
+	ASSERT_EQ(pool.iFree, 0);
+	ASSERT_EQ(freed, 0);
+	weak = weak_p<int>();
+	ASSERT_EQ(freed, 1);
+	ASSERT_EQ(gAllocations - allocations, allocated);
+}
+
+// Test copy assignment shares the object and releases the previous one
+TEST(Assignment, CopyAssignment)
+{
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Tracked> s = shared_p<Tracked>::make(5);
+		shared_p<Tracked> t = shared_p<Tracked>::make(6);
+
+		// t's object (the 6) goes
+		t = s;
+		ASSERT_EQ(gTrackedDestroyed, 1);
+		ASSERT_EQ(s.count(), 2);
+		ASSERT_EQ(t.get().iValue, 5);
+
+		t = t;
+		ASSERT_EQ(s.count(), 2);
+		ASSERT_EQ(gTrackedDestroyed, 1);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 2);
+}
+
+// Test move assignment steals the count and releases the previous object
+TEST(Assignment, MoveAssignment)
+{
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Tracked> s = shared_p<Tracked>::make(5);
+		shared_p<Tracked> t = shared_p<Tracked>::make(6);
+
+		// t's object (the 6) goes
+		t = std::move(s);
+		ASSERT_EQ(gTrackedDestroyed, 1);
+		ASSERT_EQ(t.count(), 1);
+		ASSERT_EQ(t.get().iValue, 5);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 2);
+}
+
+// Test swap, and standard algorithms which shuffle handles around
+TEST(Assignment, SwapAndAlgorithms)
+{
+	shared_p<int> one = make_shared_p<int>(1);
+	shared_p<int> two = make_shared_p<int>(2);
+	swap(one, two);
+	ASSERT_EQ(one.get(), 2);
+	ASSERT_EQ(two.get(), 1);
+
+	std::vector<shared_p<int> > values;
+	for (int i = 10; i > 1; --i)
+	{
+		values.push_back(make_shared_p<int>(i));
+	}
+	values.push_back(two);
+
+	std::sort(values.begin(), values.end(), [](shared_p<int>& aLeft, shared_p<int>& aRight) { return aLeft.get() < aRight.get(); });
+	for (int i = 0; i < 10; ++i)
+	{
+		ASSERT_EQ(values[i].get(), i + 1);
+		ASSERT_EQ(values[i].count(), i == 0 ? 2 : 1);
+	}
+
+	values.erase(values.begin());
+	ASSERT_EQ(values.size(), 9u);
+	ASSERT_EQ(values[0].get(), 2);
+	ASSERT_EQ(two.count(), 1);
+}
+
+// Move is noexcept, so std::vector moves (rather than copies) shared_p's when it reallocates
+static_assert(std::is_nothrow_move_constructible<shared_p<Data> >::value, "shared_p move should be noexcept");
+static_assert(std::is_nothrow_move_assignable<shared_p<Data> >::value, "shared_p move assignment should be noexcept");
+
+// Test empty shared_p's: default, nullptr and moved-from
+TEST(Empty, EmptyAndMovedFrom)
+{
+	shared_p<Data> none;
+	ASSERT_EQ(none.count(), 0);
+
+	shared_p<Data> alsoNone = nullptr;
+	shared_p<Data> copyOfNone = alsoNone;
+	ASSERT_EQ(copyOfNone.count(), 0);
+
+	gTrackedDestroyed = 0;
+	shared_p<Tracked> s = shared_p<Tracked>::make(5);
+	shared_p<Tracked> t = std::move(s);
+	ASSERT_EQ(s.count(), 0);
+	ASSERT_EQ(t.count(), 1);
+
+	shared_p<Tracked> other;
+	other = t;
+	ASSERT_EQ(t.count(), 2);
+
+	other = nullptr;
+	t = nullptr;
+	ASSERT_EQ(t.count(), 0);
+	ASSERT_EQ(gTrackedDestroyed, 1);
+} // destroying the empty/moved-from handles here must be harmless
+
+// Test vector growth, which moves handles into the new storage and then destroys the moved-from ones
+TEST(Empty, VectorGrowthMoves)
+{
+	shared_p<int> s = make_shared_p<int>(1);
+	std::vector<shared_p<int> > values;
+	values.push_back(s);
+	for (int i = 0; i < 100; ++i)
+	{
+		values.push_back(make_shared_p<int>(i));
+		ASSERT_EQ(s.count(), 2);
+	}
+	ASSERT_EQ(values[0].get(), 1);
+}
+
+// Test a weak_p doesn't keep the object alive, and lock() only succeeds while it is
+TEST(Weak, LockAndExpire)
+{
+	gTrackedDestroyed = 0;
+	weak_p<Tracked> w;
+	ASSERT_TRUE(w.expired());
+	{
+		shared_p<Tracked> s = shared_p<Tracked>::make(5);
+		w = s;
+		ASSERT_FALSE(w.expired());
+		ASSERT_EQ(s.count(), 1);
+
+		shared_p<Tracked> locked = w.lock();
+		ASSERT_EQ(s.count(), 2);
+		ASSERT_EQ(&locked.get(), &s.get());
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+	ASSERT_TRUE(w.expired());
+	ASSERT_EQ(w.count(), 0);
+	ASSERT_EQ(w.lock().count(), 0);
+}
+
+// Test the control block is freed when the last of the shared_p's and weak_p's goes
+TEST(Weak, BlockOutlivesObject)
+{
+	long deallocations = gDeallocations;
+	weak_p<int> w;
+	{
+		weak_p<int> other;
+		{
+			shared_p<int> s = make_shared_p<int>(5);
+			w = s;
+			other = w;
+		}
+		// object destroyed, but (being in place) its storage is the block, still held by the weak_p's
+		ASSERT_EQ(gDeallocations - deallocations, 0);
+	}
+	ASSERT_EQ(gDeallocations - deallocations, 0);
+	w = weak_p<int>();
+	ASSERT_EQ(gDeallocations - deallocations, 1);
+}
+
+// Test lock() racing with the release of the last shared_p
+TEST(Weak, ConcurrentLockAndRelease)
+{
+	for (int round = 0; round < 200; ++round)
+	{
+		std::atomic_int destroyed(0);
+		std::atomic_int locked(0);
+		shared_p<Slots> s = shared_p<Slots>::make();
+		s.get().iDestroyed = &destroyed;
+		s.get().iWritten[0] = 1;
+		weak_p<Slots> w = s;
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t)
+		{
+			threads.push_back(std::thread([&w, &locked]()
+			{
+				for (int i = 0; i < 100; ++i)
+				{
+					shared_p<Slots> l = w.lock();
+					if (l.count())
+					{
+						++locked;
+						ASSERT_EQ(l.get().iWritten[0], 1);
+					}
+				}
+			}));
+		}
+		s = nullptr;
+		for (size_t t = 0; t < threads.size(); ++t)
+		{
+			threads[t].join();
+		}
+		// destroyed exactly once (the destructor adds up iWritten)
+		ASSERT_EQ(destroyed, 1);
+		ASSERT_TRUE(w.expired());
+	}
+}
+
+// Test atomic_shared_p load/store/exchange/compare_exchange (single threaded semantics)
+TEST(Atomic, LoadStoreExchange)
+{
+	atomic_shared_p<int> a;
+	ASSERT_TRUE(a.is_lock_free());
+	ASSERT_EQ(a.load().count(), 0);
+
+	shared_p<int> one = make_shared_p<int>(1);
+	a.store(one);
+	ASSERT_EQ(one.count(), 2);
+	ASSERT_EQ(a.load().get(), 1);
+
+	shared_p<int> previous = a.exchange(make_shared_p<int>(2));
+	ASSERT_EQ(previous.get(), 1);
+	ASSERT_EQ(one.count(), 2); // one and previous
+	shared_p<int> current = a;
+	ASSERT_EQ(current.get(), 2);
+
+	shared_p<int> expected = one;
+	ASSERT_FALSE(a.compare_exchange_strong(expected, make_shared_p<int>(3)));
+	ASSERT_EQ(expected.get(), 2);
+	ASSERT_TRUE(a.compare_exchange_strong(expected, make_shared_p<int>(3)));
+	ASSERT_EQ(a.load().get(), 3);
+	ASSERT_EQ(current.count(), 2); // current and expected
+
+	a = nullptr;
+	ASSERT_EQ(a.load().count(), 0);
+}
+
+// Published snapshot whose two halves must always agree
+struct Snapshot
+{
+	Snapshot(int aVersion, std::atomic_int* aLive) : iFirst(aVersion), iSecond(aVersion), iLive(aLive) { ++*iLive; }
+	~Snapshot() { iFirst = -1; iSecond = -2; --*iLive; }
+
+	int iFirst;
+	int iSecond;
+	std::atomic_int* iLive;
+};
+
+// Test readers loading concurrently with writers storing and compare-exchanging new snapshots
+TEST(Atomic, ConcurrentReadersAndWriters)
+{
+	std::atomic_int live(0);
+	{
+		atomic_shared_p<Snapshot> published(shared_p<Snapshot>::make(0, &live));
+		std::atomic_bool stop(false);
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t)
+		{
+			threads.push_back(std::thread([&]()
+			{
+				int lastSeen = 0;
+				while (!stop)
+				{
+					shared_p<Snapshot> s = published.load();
+					ASSERT_EQ(s.get().iFirst, s.get().iSecond);
+					ASSERT_GE(s.get().iFirst, lastSeen);
+					lastSeen = s.get().iFirst;
+				}
+			}));
+		}
+		threads.push_back(std::thread([&]()
+		{
+			for (int version = 1; version < 5000; ++version)
+			{
+				if (version % 2)
+				{
+					published.store(shared_p<Snapshot>::make(version, &live));
+				}
+				else
+				{
+					shared_p<Snapshot> expected = published.load();
+					ASSERT_TRUE(published.compare_exchange_strong(expected, shared_p<Snapshot>::make(version, &live)));
+				}
+			}
+			stop = true;
+		}));
+		for (size_t t = 0; t < threads.size(); ++t)
+		{
+			threads[t].join();
+		}
+		ASSERT_EQ(published.load().get().iFirst, 4999);
+		ASSERT_EQ(live, 1);
+	}
+	ASSERT_EQ(live, 0);
+}
+
+// Message type which holds its own count
+struct Message : intrusive_ref_counter<Message>
+{
+	explicit Message(int aValue) : iValue(aValue) { }
+	~Message() { ++gTrackedDestroyed; }
+
+	int iValue;
+};
+
+// Type with a hand-written count (found through the intrusive_p customization functions)
+struct Counted
+{
+	Counted() : iCount(1) { }
+	int iCount;
+};
+
+static int gCountedDeleted = 0;
+void intrusive_p_add_ref(const Counted* aCounted) { ++const_cast<Counted*>(aCounted)->iCount; }
+void intrusive_p_release(const Counted* aCounted)
+{
+	if (--const_cast<Counted*>(aCounted)->iCount == 0)
+	{
+		++gCountedDeleted;
+		delete aCounted;
+	}
+}
+int intrusive_p_use_count(const Counted* aCounted) noexcept { return aCounted->iCount; }
+
+static_assert(sizeof(intrusive_p<Message>) == sizeof(Message*), "intrusive_p should be just a T*");
+static_assert(noexcept(intrusive_p<Message>().count()), "intrusive_p's accessors should be noexcept");
+
+// Test intrusive_p has the same ownership rules as shared_p, with the count inside the object
+TEST(Intrusive, CrtpCount)
+{
+	gTrackedDestroyed = 0;
+	long allocations = gAllocations;
+	{
+		intrusive_p<Message> m = intrusive_p<Message>::make(5);
+		ASSERT_EQ(gAllocations - allocations, 1);
+		ASSERT_EQ(m.count(), 1);
+		{
+			intrusive_p<Message> copy = m;
+			ASSERT_EQ(m.count(), 2);
+			ASSERT_EQ(copy.get().iValue, 5);
+		}
+		ASSERT_EQ(m.count(), 1);
+		ASSERT_EQ(gTrackedDestroyed, 0);
+
+		intrusive_p<Message> moved = std::move(m);
+		ASSERT_EQ(m.count(), 0);
+		ASSERT_EQ(moved.count(), 1);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test intrusive_p through hand-written customization functions, adopting a new'd object
+TEST(Intrusive, CustomCount)
+{
+	Counted* c = new Counted();
+	{
+		intrusive_p<Counted> p = intrusive_p<Counted>::make_shared(std::move(c));
+		ASSERT_EQ(c, nullptr);
+
+		intrusive_p<Counted> q;
+		q = p;
+		ASSERT_EQ(p.count(), 2);
+	}
+	ASSERT_EQ(gCountedDeleted, 1);
+}
+
+// Test pointer-like access, and operator bool
+TEST(Access, PointerOperators)
+{
+	shared_p<Tracked> s = shared_p<Tracked>::make(5);
+	ASSERT_TRUE(static_cast<bool>(s));
+	ASSERT_EQ(s->iValue, 5);
+	ASSERT_EQ((*s).iValue, 5);
+	ASSERT_EQ(&*s, &s.get());
+
+	shared_p<Tracked> t = std::move(s);
+	ASSERT_FALSE(s);
+	ASSERT_TRUE(t && t->iValue == 5);
+
+	intrusive_p<Message> m = intrusive_p<Message>::make(6);
+	ASSERT_EQ(m->iValue, 6);
+	ASSERT_FALSE(intrusive_p<Message>());
+}
+
+// Test the accessors work through a const shared_p, and noexcept follows the count policy
+TEST(Access, ConstAccessAndNoexcept)
+{
+	static_assert(std::is_nothrow_copy_constructible<shared_p<int> >::value, "atomic counts never throw");
+	static_assert(std::is_nothrow_copy_constructible<shared_p<int, biased_policy> >::value, "biased counts never throw");
+	struct throwing_policy
+	{
+		class ref_count : public unsynchronized_policy::ref_count
+		{
+		public:
+			void add_ref() { unsynchronized_policy::ref_count::add_ref(); }
+		};
+	};
+	static_assert(!std::is_nothrow_copy_constructible<shared_p<int, throwing_policy> >::value, "a policy whose add_ref may throw");
+	static_assert(std::is_nothrow_move_constructible<shared_p<int, throwing_policy> >::value, "moves never touch the count");
+	static_assert(std::is_nothrow_default_constructible<weak_p<int> >::value, "an empty weak_p can't throw");
+
+	const shared_p<int> five = make_shared_p<int>(5);
+	ASSERT_EQ(five.count(), 1);
+	ASSERT_EQ(five.get(), 5);
+	ASSERT_EQ(*five, 5);
+	ASSERT_TRUE(five);
+
+	// the object is not const, only the handle
+	*five = 6;
+	ASSERT_EQ(static_cast<int&>(five), 6);
+
+	// an empty shared_p<int> tests as false, rather than converting to (and reading) the int
+	ASSERT_FALSE(shared_p<int>());
+
+	const shared_p<int[]> array = make_shared_array<int>(4);
+	array[3] = 7;
+	ASSERT_EQ(array.data()[3], 7);
+	ASSERT_EQ(array.size(), 4u);
+}
+
+// A Tracked and a second member, for aliasing (a shared_p to a member which keeps the whole alive)
+struct Pair
+{
+	Pair(int aFirst, int aSecond) : iFirst(aFirst), iSecond(aSecond) { }
+
+	Tracked iFirst;
+	int iSecond;
+};
+
+
+// Test an aliasing shared_p keeps its owner alive, without allocating
+TEST(Casts, AliasingKeepsOwnerAlive)
+{
+	gTrackedDestroyed = 0;
+	shared_p<int> second;
+	{
+		shared_p<Pair> whole = shared_p<Pair>::make(5, 6);
+		long allocations = gAllocations;
+		second = shared_p<int>(whole, &whole->iSecond);
+		ASSERT_EQ(gAllocations, allocations);
+		ASSERT_EQ(whole.count(), 2);
+		ASSERT_EQ(*second, 6);
+	}
+	// the Pair (and its Tracked) is still alive, held by the aliasing shared_p
+	ASSERT_EQ(second.count(), 1);
+	ASSERT_EQ(gTrackedDestroyed, 0);
+
+	weak_p<int> weak = second;
+	ASSERT_EQ(weak.lock().get(), 6);
+	second = nullptr;
+	ASSERT_TRUE(weak.expired());
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Simple polymorphic hierarchy for the pointer casts
+static int gShapesDeleted = 0;
+
+struct Shape
+{
+	virtual ~Shape() { ++gShapesDeleted; }
+};
+
+struct Square : Shape
+{
+	Square(int aSide) : iSide(aSide) { }
+	int iSide;
+};
+
+struct Circle : Shape
+{
+};
+
+// Test the converting constructor and pointer casts share the control block, and only bump the count
+TEST(Casts, PointerCastsShareBlock)
+{
+	gShapesDeleted = 0;
+	{
+		shared_p<Square> square = shared_p<Square>::make(4);
+		long allocations = gAllocations;
+
+		shared_p<Shape> shape = square;
+		ASSERT_EQ(square.count(), 2);
+		ASSERT_EQ(static_cast<Shape*>(&square.get()), &shape.get());
+
+		shared_p<Square> back = static_pointer_cast<Square>(shape);
+		ASSERT_EQ(back->iSide, 4);
+		ASSERT_EQ(square.count(), 3);
+
+		shared_p<Square> checked = dynamic_pointer_cast<Square>(shape);
+		ASSERT_TRUE(checked);
+		shared_p<Circle> wrong = dynamic_pointer_cast<Circle>(shape);
+		ASSERT_FALSE(wrong);
+		ASSERT_EQ(wrong.count(), 0);
+		ASSERT_EQ(square.count(), 4);
+
+		shared_p<const Square> readOnly = square;
+		shared_p<Square> writable = const_pointer_cast<Square>(readOnly);
+		writable->iSide = 5;
+		ASSERT_EQ(square->iSide, 5);
+
+		// moving through a cast takes over the count
+		shared_p<Shape> moved = std::move(back);
+		ASSERT_FALSE(back);
+		ASSERT_EQ(square.count(), 6);
+
+		ASSERT_EQ(gAllocations, allocations);
+	}
+	ASSERT_EQ(gShapesDeleted, 1);
+}
+
+// Counts constructions and destructions of array elements
+static int gElementsConstructed = 0;
+static int gElementsDestroyed = 0;
+
+struct Element
+{
+	Element() : iValue(7) { ++gElementsConstructed; }
+	~Element() { ++gElementsDestroyed; }
+	int iValue;
+};
+
+// Test make_shared_array puts the elements in the same allocation as the block, cache line aligned
+TEST(Arrays, MakeSharedArrayIsOneAlignedAllocation)
+{
+	long allocations = gAllocations;
+	shared_p<double[]> values = make_shared_array<double>(100);
+	ASSERT_EQ(gAllocations, allocations + 1);
+	ASSERT_EQ(values.size(), 100u);
+	ASSERT_EQ(reinterpret_cast<std::uintptr_t>(values.data()) % 64, 0u);
+	ASSERT_EQ(values[99], 0.0);
+
+	shared_p<double[]> copy = values;
+	copy[5] = 2.5;
+	ASSERT_EQ(values[5], 2.5);
+	ASSERT_EQ(values.count(), 2);
+
+	gElementsConstructed = 0;
+	gElementsDestroyed = 0;
+	{
+		shared_p<Element[]> elements = make_shared_array<Element>(3);
+		ASSERT_EQ(gElementsConstructed, 3);
+		ASSERT_EQ(elements[2].iValue, 7);
+	}
+	ASSERT_EQ(gElementsDestroyed, 3);
+
+	shared_p<Element[]> none;
+	ASSERT_FALSE(none);
+	ASSERT_EQ(none.size(), 0u);
+	ASSERT_EQ(none.count(), 0);
+}
+
+// Test an adopted array is freed with delete[] (every element is destroyed)
+TEST(Arrays, AdoptedArrayUsesDeleteArray)
+{
+	gElementsDestroyed = 0;
+	{
+		Element* array = new Element[4];
+		shared_p<Element[]> elements = shared_p<Element[]>::make_shared(std::move(array), 4);
+		ASSERT_EQ(array, nullptr);
+		ASSERT_TRUE(elements);
+		ASSERT_EQ(elements.size(), 4u);
+
+		shared_p<Element[]> moved = std::move(elements);
+		ASSERT_FALSE(elements);
+		ASSERT_EQ(moved.count(), 1);
+		ASSERT_EQ(gElementsDestroyed, 0);
+	}
+	ASSERT_EQ(gElementsDestroyed, 4);
+}
+
+// Test an array too large to allocate throws, as new T[n] would, rather than the size wrapping round
+TEST(Arrays, TooLargeArrayThrows)
+{
+	gElementsConstructed = 0;
+	ASSERT_THROW(make_shared_array<Element>(SIZE_MAX / sizeof(Element)), std::bad_array_new_length);
+	ASSERT_THROW(make_shared_array<Element>(SIZE_MAX), std::bad_array_new_length);
+	ASSERT_EQ(gElementsConstructed, 0);
+}
+
+// Policy which counts the operations made on its counts (so tests can check batching)
+static int gCountOperations = 0;
+
+struct operation_counting_policy
+{
+	class ref_count : public unsynchronized_policy::ref_count
+	{
+	public:
+		void add_ref() { ++gCountOperations; unsynchronized_policy::ref_count::add_ref(); }
+		void add_ref(int aCount) { ++gCountOperations; unsynchronized_policy::ref_count::add_ref(aCount); }
+		bool release() { ++gCountOperations; return unsynchronized_policy::ref_count::release(); }
+		bool release(int aCount) { ++gCountOperations; return unsynchronized_policy::ref_count::release(aCount); }
+	};
+};
+
+// Test share_n hands out N copies for one count operation, and release_n takes them back for one more
+TEST(Batch, ShareAndReleaseN)
+{
+	gTrackedDestroyed = 0;
+	shared_p<Tracked, operation_counting_policy> packet = shared_p<Tracked, operation_counting_policy>::make(5);
+	std::vector<shared_p<Tracked, operation_counting_policy> > queues(64);
+
+	gCountOperations = 0;
+	packet.share_n(queues.size(), queues.begin());
+	ASSERT_EQ(gCountOperations, 1);
+	ASSERT_EQ(packet.count(), 65);
+	ASSERT_EQ(&queues[63].get(), &packet.get());
+
+	shared_p<Tracked, operation_counting_policy>::release_n(queues.begin(), queues.size());
+	ASSERT_EQ(gCountOperations, 2);
+	ASSERT_EQ(packet.count(), 1);
+	ASSERT_FALSE(queues[0]);
+
+	// more copies than an int count holds are refused, before any count is added
+	gCountOperations = 0;
+	ASSERT_THROW(packet.share_n(static_cast<std::size_t>(INT_MAX) + 1, queues.begin()), std::length_error);
+	ASSERT_EQ(gCountOperations, 0);
+	ASSERT_EQ(packet.count(), 1);
+
+	// runs of different blocks (and empty shared_p's) are released separately, and the last release destroys
+	std::vector<shared_p<Tracked, operation_counting_policy> > mixed;
+	shared_p<Tracked, operation_counting_policy> other = shared_p<Tracked, operation_counting_policy>::make(6);
+	packet.share_n(3, std::back_inserter(mixed));
+	mixed.push_back(shared_p<Tracked, operation_counting_policy>());
+	other.share_n(2, std::back_inserter(mixed));
+	packet = nullptr;
+	other = nullptr;
+	ASSERT_EQ(gTrackedDestroyed, 0);
+
+	gCountOperations = 0;
+	shared_p<Tracked, operation_counting_policy>::release_n(mixed.begin(), mixed.size());
+	ASSERT_EQ(gCountOperations, 2);
+	ASSERT_EQ(gTrackedDestroyed, 2);
+}
+
+// An object which hands out shared_p's to itself, from its own member functions
+struct Connection : enable_shared_p_from_this<Connection>
+{
+	explicit Connection(int aValue) : iTracked(aValue) { }
+
+	shared_p<Connection> callback() { return shared_from_this(); }
+
+	Tracked iTracked;
+};
+
+// Test shared_from_this shares the block make (or make_shared) created, without allocating
+TEST(FromThis, SharesTheExistingBlock)
+{
+	gTrackedDestroyed = 0;
+	{
+		shared_p<Connection> connection = shared_p<Connection>::make(5);
+		long allocations = gAllocations;
+		shared_p<Connection> callback = connection->callback();
+		ASSERT_EQ(gAllocations, allocations);
+		ASSERT_EQ(connection.count(), 2);
+		ASSERT_EQ(&callback.get(), &connection.get());
+
+		const Connection& constant = connection.get();
+		shared_p<const Connection> reader = constant.shared_from_this();
+		ASSERT_EQ(connection.count(), 3);
+
+		// the callback alone keeps the object alive (destroyed once, by the last of them)
+		connection = nullptr;
+		reader = nullptr;
+		ASSERT_EQ(gTrackedDestroyed, 0);
+		ASSERT_EQ(callback->iTracked.iValue, 5);
+		ASSERT_EQ(callback.count(), 1);
+	}
+	ASSERT_EQ(gTrackedDestroyed, 1);
+
+	shared_p<Connection> adopted = shared_p<Connection>::make_shared(new Connection(6));
+	ASSERT_EQ(adopted->callback().count(), 2);
+	weak_p<Connection> weak = adopted->weak_from_this();
+	ASSERT_EQ(weak.count(), 1);
+	adopted = nullptr;
+	ASSERT_TRUE(weak.expired());
+
+	// a const owner still fills in the base
+	shared_p<const Connection> constant = shared_p<const Connection>::make(7);
+	shared_p<const Connection> shared = constant->shared_from_this();
+	ASSERT_EQ(constant.count(), 2);
+	ASSERT_EQ(&shared.get(), &constant.get());
+}
+
+// Test an object not owned by a shared_p (or owned as a base) gets an empty shared_p, or one sharing the block
+TEST(FromThis, UnownedAndDerived)
+{
+	Connection local(7);
+	ASSERT_FALSE(local.shared_from_this());
+	ASSERT_TRUE(local.weak_from_this().expired());
+
+	struct Derived : Connection
+	{
+		Derived() : Connection(8) { }
+	};
+	shared_p<Derived> derived = shared_p<Derived>::make();
+	shared_p<Connection> base = derived->callback();
+	ASSERT_EQ(derived.count(), 2);
+	ASSERT_EQ(&base.get(), static_cast<Connection*>(&derived.get()));
+
+	// a copy of the object is not owned by the original's shared_p's
+	Connection copy(derived.get());
+	ASSERT_FALSE(copy.shared_from_this());
+}
+
+// Handlers which pass a borrowed request down the call chain
+static int Depth(borrowed_p<Tracked, operation_counting_policy> aRequest, int aLevels)
+{
+	return aLevels ? Depth(aRequest, aLevels - 1) : aRequest->iValue;
+}
+
+// Test passing a borrowed_p down touches no count, and promote shares ownership when it has to escape
+TEST(Borrowed, PassingTouchesNoCount)
+{
+	static_assert(!std::is_copy_assignable<borrowed_p<int> >::value, "borrowed_p must not be storable");
+	static_assert(!std::is_constructible<borrowed_p<int>, shared_p<int> >::value, "borrowed_p must not borrow a temporary");
+	static_assert(std::is_trivially_copy_constructible<borrowed_p<int> >::value, "borrowing must be two pointer copies");
+
+	gTrackedDestroyed = 0;
+	shared_p<Tracked, operation_counting_policy> request = shared_p<Tracked, operation_counting_policy>::make(5);
+
+	gCountOperations = 0;
+	ASSERT_EQ(Depth(request, 8), 5);
+	ASSERT_EQ(gCountOperations, 0);
+
+	borrowed_p<Tracked, operation_counting_policy> borrowed = request;
+	ASSERT_EQ(borrowed.count(), 1);
+	ASSERT_EQ(&borrowed.get(), &request.get());
+	shared_p<Tracked, operation_counting_policy> escaped = borrowed.promote();
+	ASSERT_EQ(gCountOperations, 1);
+	ASSERT_EQ(request.count(), 2);
+
+	// the promoted shared_p keeps the object alive after the lender has gone
+	request = nullptr;
+	ASSERT_EQ(gTrackedDestroyed, 0);
+	ASSERT_EQ(escaped->iValue, 5);
+	escaped = nullptr;
+	ASSERT_EQ(gTrackedDestroyed, 1);
+}
+
+// Test borrowing an empty shared_p, or a shared_p of a derived type
+TEST(Borrowed, EmptyAndConverting)
+{
+	shared_p<int> none;
+	borrowed_p<int> empty = none;
+	ASSERT_FALSE(empty);
+	ASSERT_EQ(empty.count(), 0);
+	ASSERT_EQ(empty.promote().count(), 0);
+
+	gShapesDeleted = 0;
+	shared_p<Square> square = shared_p<Square>::make(3);
+	borrowed_p<Shape> shape = square;
+	ASSERT_EQ(static_cast<Shape*>(&square.get()), &shape.get());
+	shared_p<Shape> owner = shape.promote();
+	square = nullptr;
+	ASSERT_EQ(gShapesDeleted, 0);
+	owner = nullptr;
+	ASSERT_EQ(gShapesDeleted, 1);
+}
+
+// Test an object made with make_deferred is destroyed when the queue is drained, not when it is released
+TEST(Deferred, DestroyedOnDrain)
+{
+	shared_p_deferred_queue queue;
+	gShapesDeleted = 0;
+
+	shared_p<Square> square = shared_p<Square>::make_deferred(queue, 4);
+	shared_p<Shape> shape = square;
+	weak_p<Square> weak = square;
+	ASSERT_TRUE(queue.empty());
+
+	long deallocations = gDeallocations;
+	square = nullptr;
+	shape = nullptr;
+	ASSERT_TRUE(weak.expired());
+	ASSERT_FALSE(queue.empty());
+	ASSERT_EQ(gShapesDeleted, 0);
+	ASSERT_EQ(gDeallocations, deallocations);
+
+	ASSERT_EQ(queue.drain(), 1u);
+	ASSERT_EQ(gShapesDeleted, 1);
+	ASSERT_TRUE(queue.empty());
+
+	// the weak_p still holds the block; it is freed when the weak_p goes
+	ASSERT_EQ(gDeallocations, deallocations);
+	weak = weak_p<Square>();
+	ASSERT_EQ(gDeallocations, deallocations + 1);
+	ASSERT_EQ(queue.drain(), 0u);
+}
+
+// Test a shared_p_reclaimer destroys released objects on its own thread
+TEST(Deferred, BackgroundReclaimer)
+{
+	shared_p_deferred_queue queue;
+	std::atomic<int> destroyed(0);
+
+	struct Index
+	{
+		Index(std::atomic<int>& aDestroyed) : iDestroyed(aDestroyed), iOwner(std::this_thread::get_id()) { }
+		~Index() { iDestroyed += std::this_thread::get_id() != iOwner ? 1 : 100; }
+		std::atomic<int>& iDestroyed;
+		std::thread::id iOwner;
+	};
+
+	{
+		shared_p_reclaimer reclaimer(queue);
+		for (int i = 0; i < 10; ++i)
+		{
+			shared_p<Index> index = shared_p<Index>::make_deferred(queue, destroyed);
+		}
+		while (destroyed < 10)
+		{
+			std::this_thread::yield();
+		}
+	}
+	ASSERT_EQ(destroyed, 10);
+	ASSERT_TRUE(queue.empty());
+}
+
+// Test readers inside a guard see an epoch_p's object without a count operation
+TEST(Epoch, ReadersSeeWithoutCounting)
+{
+	epoch_p<Tracked, operation_counting_policy> published(shared_p<Tracked, operation_counting_policy>::make(5));
+
+	gCountOperations = 0;
+	{
+		shared_p_epoch::guard pinned;
+		for (int i = 0; i < 100; ++i)
+		{
+			const Tracked* tracked = published.get(pinned);
+			ASSERT_EQ(tracked->iValue, 5);
+		}
+	}
+	ASSERT_EQ(gCountOperations, 0);
+
+	// load() keeps the object, for one count
+	shared_p<Tracked, operation_counting_policy> kept = published.load();
+	ASSERT_EQ(gCountOperations, 1);
+	ASSERT_EQ(kept.count(), 2);
+
+	epoch_p<Tracked> empty;
+	shared_p_epoch::guard pinned;
+	ASSERT_EQ(empty.get(pinned), nullptr);
+	ASSERT_EQ(empty.load().count(), 0);
+}
+
+// Test a replaced value is not released while a reader which may see it is still in its guard
+TEST(Epoch, ReleaseDeferredUntilReadersLeave)
+{
+	shared_p_epoch::reclaim();
+	ASSERT_EQ(shared_p_epoch::pending(), 0u);
+
+	gTrackedDestroyed = 0;
+	epoch_p<Tracked> published(shared_p<Tracked>::make(5));
+	{
+		shared_p_epoch::guard pinned;
+		const Tracked* seen = published.get(pinned);
+
+		// nested guards don't re-pin
+		{
+			shared_p_epoch::guard nested;
+		}
+
+		published.store(shared_p<Tracked>::make(6));
+		ASSERT_EQ(shared_p_epoch::pending(), 1u);
+		ASSERT_EQ(shared_p_epoch::reclaim(), 0u);
+		ASSERT_EQ(gTrackedDestroyed, 0);
+		ASSERT_EQ(seen->iValue, 5);
+		ASSERT_EQ(published.get(pinned)->iValue, 6);
+	}
+
+	ASSERT_EQ(shared_p_epoch::reclaim(), 1u);
+	ASSERT_EQ(shared_p_epoch::pending(), 0u);
+	ASSERT_EQ(gTrackedDestroyed, 1);
+
+	// a value kept with load() outlives its retirement
+	shared_p<Tracked> kept = published.load();
+	published.store(shared_p<Tracked>());
+	ASSERT_EQ(shared_p_epoch::reclaim(), 0u);
+	ASSERT_EQ(shared_p_epoch::pending(), 0u);
+	ASSERT_EQ(gTrackedDestroyed, 1);
+	ASSERT_EQ(kept->iValue, 6);
+	ASSERT_EQ(kept.count(), 1);
+}
+
+// Test readers on many threads always see a live object while a writer keeps replacing it
+TEST(Epoch, ConcurrentReadersAndStores)
+{
+	struct Version
+	{
+		Version(int aNumber) : iNumber(aNumber), iAlive(0x600d) { }
+		~Version() { iAlive = 0; }
+		int iNumber;
+		int iAlive;
+	};
+
+	epoch_p<Version> published(shared_p<Version>::make(0));
+	std::atomic<bool> done(false);
+	std::atomic<int> bad(0);
+
+	std::vector<std::thread> readers;
+	for (int r = 0; r < 4; ++r)
+	{
+		readers.push_back(std::thread([&]()
+		{
+			int newest = 0;
+			while (!done)
+			{
+				shared_p_epoch::guard pinned;
+				const Version* version = published.get(pinned);
+				if (version->iAlive != 0x600d || version->iNumber < newest)
+				{
+					++bad;
+				}
+				newest = version->iNumber;
+			}
+		}));
+	}
+
+	for (int i = 1; i <= 1000; ++i)
+	{
+		published.store(shared_p<Version>::make(i));
+	}
+	done = true;
+	for (std::size_t r = 0; r < readers.size(); ++r)
+	{
+		readers[r].join();
+	}
+
+	ASSERT_EQ(bad, 0);
+	shared_p_epoch::reclaim();
+	ASSERT_EQ(shared_p_epoch::pending(), 0u);
+}
+
+#ifdef SHARED_P_INSTRUMENTATION
+// Only counted by the instrumentation tests
+struct Instrumented
+{
+	explicit Instrumented(int aValue) : iValue(aValue) { }
+	int iValue;
+};
+
+// The counters recorded for Instrumented so far
+static shared_p_stats InstrumentedStats()
+{
+	std::vector<shared_p_stats> stats = shared_p_instrumentation::snapshot();
+	for (std::size_t i = 0; i < stats.size(); ++i)
+	{
+		if (std::string(stats[i].iType) == typeid(Instrumented).name())
+		{
+			return stats[i];
+		}
+	}
+	shared_p_stats none = { typeid(Instrumented).name(), 0, 0, 0, 0, 0, 0, 0 };
+	return none;
+}
+
+// Test constructs, copies, moves, final releases and live bytes are counted per type, across threads
+TEST(Instrumentation, CountsPerType)
+{
+	shared_p_stats before = InstrumentedStats();
+	{
+		shared_p<Instrumented> first = shared_p<Instrumented>::make(1);
+		shared_p<Instrumented> second = shared_p<Instrumented>::make_shared(new Instrumented(2));
+		shared_p_stats live = InstrumentedStats();
+		ASSERT_EQ(live.iConstructs, before.iConstructs + 2);
+		ASSERT_EQ(live.iLiveBlocks, before.iLiveBlocks + 2);
+		ASSERT_GT(live.iLiveBytes, before.iLiveBytes);
+		ASSERT_GE(live.iPeakLiveBytes, live.iLiveBytes);
+
+		shared_p<Instrumented> copy = first;
+		shared_p<Instrumented> moved = std::move(copy);
+
+		// copies made on another thread are counted too (once that thread has gone)
+		std::thread([&second] { shared_p<Instrumented> copies[3] = { second, second, second }; }).join();
+
+		shared_p_stats counted = InstrumentedStats();
+		ASSERT_EQ(counted.iCopies, before.iCopies + 4);
+		ASSERT_GE(counted.iMoves, before.iMoves + 1);
+		ASSERT_EQ(counted.iFinalReleases, before.iFinalReleases);
+	}
+
+	shared_p_stats after = InstrumentedStats();
+	ASSERT_EQ(after.iFinalReleases, before.iFinalReleases + 2);
+	ASSERT_EQ(after.iLiveBlocks, before.iLiveBlocks);
+	ASSERT_EQ(after.iLiveBytes, before.iLiveBytes);
+}
+
+// Test the export writes one line per type
+TEST(Instrumentation, WritesSnapshot)
+{
+	shared_p<Instrumented> object = shared_p<Instrumented>::make(3);
+	std::ostringstream out;
+	shared_p_instrumentation::write(out);
+	ASSERT_NE(out.str().find(std::string(typeid(Instrumented).name()) + " constructs="), std::string::npos);
+	ASSERT_NE(out.str().find("live_blocks="), std::string::npos);
+}
+#endif
+
+#ifdef SHARED_P_DEBUG_REGISTRY
+// A node which can be made part of a reference cycle
+struct Node
+{
+	shared_p<Node> iNext;
+};
+
+// Test live blocks are listed with their type, count and allocation site, until they are freed
+TEST(Registry, ListsLiveBlocks)
+{
+	std::size_t live = shared_p_registry::live();
+	shared_p<Node> node = SHARED_P_SITE(shared_p<Node>::make());
+	const int line = __LINE__ - 1;
+	shared_p<Node> copy = node;
+	weak_p<Node> weak = node;
+	ASSERT_EQ(shared_p_registry::live(), live + 1);
+
+	std::ostringstream out;
+	ASSERT_EQ(shared_p_registry::dump_live(out), live + 1);
+	std::ostringstream expected;
+	expected << typeid(Node).name() << " use_count=2 made at " << __FILE__ << ':' << line;
+	ASSERT_NE(out.str().find(expected.str()), std::string::npos);
+
+	// the block stays registered while the weak_p holds it
+	node = nullptr;
+	copy = nullptr;
+	ASSERT_EQ(shared_p_registry::live(), live + 1);
+	weak = weak_p<Node>();
+	ASSERT_EQ(shared_p_registry::live(), live);
+}
+
+// Test a reference cycle shows up as blocks which stay live once every outside handle has gone
+TEST(Registry, ShowsCycles)
+{
+	std::size_t live = shared_p_registry::live();
+	weak_p<Node> survivor;
+	{
+		shared_p<Node> first = shared_p<Node>::make();
+		shared_p<Node> second = shared_p<Node>::make();
+		first->iNext = second;
+		second->iNext = first;
+		survivor = first;
+	}
+	ASSERT_EQ(shared_p_registry::live(), live + 2);
+
+	// break the cycle, so the blocks are freed and not reported at exit
+	survivor.lock()->iNext = nullptr;
+	survivor = weak_p<Node>();
+	ASSERT_EQ(shared_p_registry::live(), live);
+}
+#endif
+
+#ifdef _MSC_VER
+int main(int argc, char** argv)
+{
+	CanCreateShPofIntPtr();
+	CanCreateShPOfData();
+	CanCreate2ShP();
+	CanCreate2ShP_DiffSharedLifetimes();
+	TestOperatorT();
+	TestOperatorGet();
+	TestDeleter();
+	TestCanCallFunctionWithoutSharedPSigniture();
+	CanMakeInPlace();
+	MakeForwardsArguments();
+	MakeSharedAllocatesOnlyControlBlock();
+	MakeAllocatesOnce();
+	RelocateKeepsOwnership();
+	ConcurrentCopyAndDestroy();
+	UnsynchronizedPolicy();
+	BiasedPolicy();
+	BiasedConcurrentCopyAndDestroy();
+	BiasedOwnerExits();
+	PaddedPolicy();
+	WidePolicy();
+	PackedPolicy();
+	PackedConcurrentCopyAndDestroy();
+	ShardedPolicy();
+	ShardedConcurrentCopyAndDestroy();
+	AllocateSharedUsesAllocator();
+	MakePooledRecyclesBlocks();
+	MakePooledOutlivesThePool();
+	LambdaDeleter();
+	StatelessDeleterTakesNoSpace();
+	StatefulDeleterIsInline();
+	DeleterWithAllocator();
+	CopyAssignment();
+	MoveAssignment();
+	SwapAndAlgorithms();
+	EmptyAndMovedFrom();
+	VectorGrowthMoves();
+	LockAndExpire();
+	BlockOutlivesObject();
+	ConcurrentLockAndRelease();
+	LoadStoreExchange();
+	ConcurrentReadersAndWriters();
+	CrtpCount();
+	CustomCount();
+	PointerOperators();
+	ConstAccessAndNoexcept();
+	AliasingKeepsOwnerAlive();
+	PointerCastsShareBlock();
+	MakeSharedArrayIsOneAlignedAllocation();
+	AdoptedArrayUsesDeleteArray();
+	TooLargeArrayThrows();
+	ShareAndReleaseN();
+	SharesTheExistingBlock();
+	UnownedAndDerived();
+	PassingTouchesNoCount();
+	EmptyAndConverting();
+	DestroyedOnDrain();
+	BackgroundReclaimer();
+	ReadersSeeWithoutCounting();
+	ReleaseDeferredUntilReadersLeave();
+	ConcurrentReadersAndStores();
+#ifdef SHARED_P_INSTRUMENTATION
+	CountsPerType();
+	WritesSnapshot();
+#endif
+#ifdef SHARED_P_DEBUG_REGISTRY
+	ListsLiveBlocks();
+	ShowsCycles();
+#endif
+	return 0;
+}
+#endif